@@ -0,0 +1,245 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <vector>
+
+// opencv
+#include <opencv2/core.hpp>
+
+// project
+#include "profile.hpp"
+
+
+namespace zhou {
+
+	// Bump allocator for the temporaries of a single candidate
+	//
+	// Memory is taken from a few large blocks and given back all at once when
+	// the scratchscope it was allocated in ends. Once the blocks are large
+	// enough for everything a candidate needs (after the first few candidates)
+	// evaluating a candidate no longer touches the heap, so candidates scored
+	// on different threads don't contend for it either.
+	//
+	// Every allocation must be released (the Mat or container destroyed, or the
+	// data copied out) before its scope ends. Each thread has its own arena.
+	class scratcharena {
+	private:
+		struct block {
+			std::unique_ptr<unsigned char[]> data;
+			size_t size;
+		};
+
+		std::vector<block> m_blocks;
+		size_t m_current = 0; // block being allocated from
+		size_t m_offset = 0;  // first free byte in the current block
+		int m_depth = 0;      // open scopes
+		std::atomic<int> m_live{ 0 };
+
+	public:
+		static constexpr size_t minimumBlock = 1 << 20;
+
+		struct mark {
+			size_t block;
+			size_t offset;
+			int live;
+		};
+
+		scratcharena() { }
+		scratcharena(const scratcharena &) = delete;
+		scratcharena & operator=(const scratcharena &) = delete;
+
+		void * allocate(size_t bytes, size_t alignment = 64) {
+			while (true) {
+				// the rest of the current block, or the next block that fits
+				for (; m_current < m_blocks.size(); ++m_current, m_offset = 0) {
+					uintptr_t base = reinterpret_cast<uintptr_t>(m_blocks[m_current].data.get());
+					size_t start = ((base + m_offset + alignment - 1) & ~uintptr_t(alignment - 1)) - base;
+					if (start + bytes <= m_blocks[m_current].size) {
+						m_offset = start + bytes;
+						m_live++;
+						return m_blocks[m_current].data.get() + start;
+					}
+				}
+
+				// blocks at least double, so a candidate settles into a few of them
+				size_t size = std::max(minimumBlock, bytes + alignment);
+				if (!m_blocks.empty()) size = std::max(size, 2 * m_blocks.back().size);
+				m_blocks.push_back(block{ std::unique_ptr<unsigned char[]>(new unsigned char[size]), size });
+				profile::counter("scratch.growth", double(size));
+				m_current = m_blocks.size() - 1;
+				m_offset = 0;
+			}
+		}
+
+		// releases an allocation, the memory is reused once its scope ends
+		// (safe from any thread)
+		void release() {
+			m_live--;
+		}
+
+		// whether allocations should come from the arena (inside a scope)
+		bool active() const { return m_depth > 0; }
+
+		size_t bytes() const {
+			size_t total = 0;
+			for (const block &b : m_blocks) total += b.size;
+			return total;
+		}
+
+		mark enter() {
+			m_depth++;
+			return mark{ m_current, m_offset, m_live.load() };
+		}
+
+		void leave(const mark &m) {
+			assert(m_depth > 0);
+			// anything allocated in the scope must have been released, otherwise
+			// the memory still in use would be handed out again
+			if (m_live.load() > m.live) {
+				std::cerr << "Scratch memory still in use at the end of its scope (" << (m_live.load() - m.live) << " allocations)" << std::endl;
+				std::abort();
+			}
+			m_depth--;
+			m_current = m.block;
+			m_offset = m.offset;
+		}
+	};
+
+
+	inline scratcharena & threadArena() {
+		thread_local scratcharena arena;
+		return arena;
+	}
+
+
+	// scratch allocations on this thread are made from its arena for as long as
+	// the scope exists, and the arena is rewound when it ends
+	class scratchscope {
+	private:
+		scratcharena &m_arena;
+		scratcharena::mark m_mark;
+
+	public:
+		scratchscope() : m_arena(threadArena()), m_mark(m_arena.enter()) { }
+		scratchscope(const scratchscope &) = delete;
+		scratchscope & operator=(const scratchscope &) = delete;
+		~scratchscope() { m_arena.leave(m_mark); }
+	};
+
+
+	// std allocator on the thread's arena inside a scratchscope, and on the heap
+	// otherwise
+	// each allocation is preceded by the arena it came from (null for the heap),
+	// so it can be deallocated on any thread
+	template <typename T>
+	struct scratchallocator {
+		typedef T value_type;
+
+		scratchallocator() noexcept { }
+		template <typename U>
+		scratchallocator(const scratchallocator<U> &) noexcept { }
+
+		T * allocate(size_t n) {
+			scratcharena &arena = threadArena();
+			scratcharena *owner = arena.active() ? &arena : nullptr;
+			size_t bytes = header() + n * sizeof(T);
+			unsigned char *base = static_cast<unsigned char *>(owner ? arena.allocate(bytes, std::max(alignof(T), alignof(scratcharena *))) : ::operator new(bytes));
+			unsigned char *data = base + header();
+			*reinterpret_cast<scratcharena **>(data - sizeof(scratcharena *)) = owner;
+			return reinterpret_cast<T *>(data);
+		}
+
+		void deallocate(T *p, size_t) {
+			unsigned char *data = reinterpret_cast<unsigned char *>(p);
+			scratcharena *owner = *reinterpret_cast<scratcharena **>(data - sizeof(scratcharena *));
+			if (owner) owner->release();
+			else ::operator delete(data - header());
+		}
+
+		template <typename U> bool operator==(const scratchallocator<U> &) const { return true; }
+		template <typename U> bool operator!=(const scratchallocator<U> &) const { return false; }
+
+	private:
+		// room for the owner, keeping the data aligned for T
+		static size_t header() {
+			size_t a = std::max(alignof(T), alignof(scratcharena *));
+			return (sizeof(scratcharena *) + a - 1) / a * a;
+		}
+	};
+
+
+	namespace detail {
+
+#if CV_VERSION_MAJOR >= 4
+		typedef cv::AccessFlag accessflag;
+#else
+		typedef int accessflag;
+#endif
+
+		// cv::Mat data (and its UMatData) allocated from the arena of the thread
+		// that created the Mat, the Mat can be destroyed on any thread
+		class scratchmatallocator : public cv::MatAllocator {
+		public:
+			cv::UMatData * allocate(int dims, const int *sizes, int type, void *data, size_t *step, accessflag flags, cv::UMatUsageFlags usage) const override {
+				// (wrapping user data is left to OpenCV, which then also frees it)
+				if (data) return cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usage);
+
+				size_t total = CV_ELEM_SIZE(type);
+				for (int i = dims - 1; i >= 0; --i) {
+					if (step) step[i] = total;
+					total *= sizes[i];
+				}
+
+				scratcharena &arena = threadArena();
+				cv::UMatData *u = new (arena.allocate(sizeof(cv::UMatData), alignof(cv::UMatData))) cv::UMatData(this);
+				u->data = u->origdata = static_cast<uchar *>(arena.allocate(total));
+				u->size = total;
+				u->userdata = &arena;
+				return u;
+			}
+
+			bool allocate(cv::UMatData *u, accessflag, cv::UMatUsageFlags) const override {
+				return u != nullptr;
+			}
+
+			void deallocate(cv::UMatData *u) const override {
+				if (!u) return;
+				scratcharena *arena = static_cast<scratcharena *>(u->userdata);
+				u->~UMatData();
+				arena->release(); // data
+				arena->release(); // UMatData
+			}
+		};
+	}
+
+
+	// an empty Mat that allocates from the thread's arena when it is created
+	// inside a scratchscope (and from the heap otherwise)
+	inline cv::Mat scratchMat() {
+		static detail::scratchmatallocator allocator;
+		cv::Mat m;
+		if (threadArena().active()) m.allocator = &allocator;
+		return m;
+	}
+
+	inline cv::Mat scratchMat(int rows, int cols, int type) {
+		cv::Mat m = scratchMat();
+		m.create(rows, cols, type);
+		return m;
+	}
+
+	inline cv::Mat scratchMat(int rows, int cols, int type, const cv::Scalar &value) {
+		cv::Mat m = scratchMat(rows, cols, type);
+		m.setTo(value);
+		return m;
+	}
+}
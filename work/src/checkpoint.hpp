@@ -0,0 +1,412 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// opencv
+#include <opencv2/core.hpp>
+
+// project
+#include "featurepatch.hpp"
+#include "profile.hpp"
+
+
+namespace zhou {
+
+	// a patch written into the synthesis
+	struct placementrecord {
+		int phase;            // checkpoint::PHASE_FEATURE or checkpoint::PHASE_NONFEATURE
+		cv::Vec2i position;   // topleft in the synthesis
+		cv::Mat graphcut;     // CV_8UC1, where the patch was used
+	};
+
+
+	// Everything needed to continue a synthesis run
+	//
+	// The feature patches and targets are kept so a resumed run doesn't need to
+	// repeat the feature analysis. The non-feature queue is not stored, it is
+	// rebuilt from the synthesis (a target's priority is its number of uncovered
+	// pixels) and the targets already placed in the current pass.
+	struct checkpoint {
+		enum {
+			PHASE_FEATURE,
+			PHASE_NONFEATURE,
+			PHASE_DONE
+		};
+
+		int phase = PHASE_FEATURE;
+		int patchsize = 0;
+		std::vector<cv::Size> exampleSizes;       // of every example in the library
+		cv::Mat synthesis;                        // CV_32FC1, NaN where unsynthesized
+
+		std::vector<fpatch> featurepatches;
+		std::vector<fpatch> featuretargets;
+		std::vector<int> pendingFeatures;         // indices into featuretargets still to be placed
+
+		int nonfeatureOffset = 0;                 // offset of the current non-feature pass
+		std::vector<unsigned char> nonfeatureDone; // per target of the current pass
+
+		std::vector<placementrecord> placements;
+
+		cv::Mat provenanceCoords;                 // empty if provenance isn't recorded
+		cv::Mat provenanceIds;
+		cv::Mat provenanceExamples;
+	};
+
+
+	namespace detail {
+
+		static const char checkpointMagic[8] = { 'Z', 'H', 'O', 'U', 'C', 'K', 'P', 'T' };
+		static const uint32_t checkpointVersion = 3;
+
+		template <typename T>
+		void writeValue(std::ostream &out, const T &v) {
+			out.write(reinterpret_cast<const char *>(&v), sizeof(T));
+		}
+
+		template <typename T>
+		void readValue(std::istream &in, T &v) {
+			in.read(reinterpret_cast<char *>(&v), sizeof(T));
+			if (!in) throw std::runtime_error("Truncated checkpoint.");
+		}
+
+		// bytes left to read in the stream
+		inline uint64_t remainingBytes(std::istream &in) {
+			std::istream::pos_type pos = in.tellg();
+			if (pos == std::istream::pos_type(-1)) throw std::runtime_error("Truncated checkpoint.");
+			in.seekg(0, std::ios::end);
+			std::istream::pos_type end = in.tellg();
+			in.seekg(pos);
+			if (!in || end < pos) throw std::runtime_error("Truncated checkpoint.");
+			return uint64_t(end - pos);
+		}
+
+		// reads a count of items taking at least itemBytes each, checked against
+		// what is left in the stream before anything is allocated for them
+		inline uint64_t readCount(std::istream &in, size_t itemBytes) {
+			uint64_t n;
+			readValue(in, n);
+			if (n > remainingBytes(in) / std::max<size_t>(itemBytes, 1)) throw std::runtime_error("Truncated checkpoint.");
+			return n;
+		}
+
+		template <typename T>
+		void writeVector(std::ostream &out, const std::vector<T> &v) {
+			writeValue(out, uint64_t(v.size()));
+			if (!v.empty()) out.write(reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T));
+		}
+
+		template <typename T>
+		void readVector(std::istream &in, std::vector<T> &v) {
+			uint64_t n = readCount(in, sizeof(T));
+			v.resize(n);
+			if (n > 0) in.read(reinterpret_cast<char *>(v.data()), n * sizeof(T));
+			if (!in) throw std::runtime_error("Truncated checkpoint.");
+		}
+
+		inline void writeMat(std::ostream &out, const cv::Mat m) {
+			writeValue(out, int32_t(m.rows));
+			writeValue(out, int32_t(m.cols));
+			writeValue(out, int32_t(m.type()));
+			for (int i = 0; i < m.rows; ++i) {
+				out.write(reinterpret_cast<const char *>(m.ptr(i)), m.cols * m.elemSize());
+			}
+		}
+
+		inline cv::Mat readMat(std::istream &in) {
+			int32_t rows, cols, type;
+			readValue(in, rows);
+			readValue(in, cols);
+			readValue(in, type);
+			if (rows < 0 || cols < 0) throw std::runtime_error("Invalid matrix in checkpoint.");
+			if (uint64_t(rows) * cols * CV_ELEM_SIZE(type) > remainingBytes(in)) throw std::runtime_error("Truncated checkpoint.");
+			cv::Mat m(rows, cols, type);
+			for (int i = 0; i < m.rows; ++i) {
+				in.read(reinterpret_cast<char *>(m.ptr(i)), m.cols * m.elemSize());
+			}
+			if (!in) throw std::runtime_error("Truncated checkpoint.");
+			return m;
+		}
+
+		inline void writePatches(std::ostream &out, const std::vector<fpatch> &patches) {
+			writeValue(out, uint64_t(patches.size()));
+			for (const fpatch &fp : patches) {
+				writeValue(out, fp.center);
+				writeVector(out, fp.controlpoints);
+				writeValue(out, int32_t(fp.example));
+			}
+		}
+
+		inline void readPatches(std::istream &in, std::vector<fpatch> &patches) {
+			// center, control point count and example
+			uint64_t n = readCount(in, sizeof(cv::Vec2f) + sizeof(uint64_t) + sizeof(int32_t));
+			patches.resize(n);
+			for (fpatch &fp : patches) {
+				int32_t example;
+				readValue(in, fp.center);
+				readVector(in, fp.controlpoints);
+				readValue(in, example);
+				fp.example = example;
+			}
+		}
+
+		// graphcut masks are stored as bits
+		inline void writeMask(std::ostream &out, const cv::Mat mask) {
+			writeValue(out, int32_t(mask.rows));
+			writeValue(out, int32_t(mask.cols));
+			std::vector<unsigned char> bits((mask.total() + 7) / 8, 0);
+			size_t k = 0;
+			for (int i = 0; i < mask.rows; ++i) {
+				const unsigned char *m = mask.ptr<unsigned char>(i);
+				for (int j = 0; j < mask.cols; ++j, ++k) {
+					if (m[j]) bits[k / 8] |= (1 << (k % 8));
+				}
+			}
+			out.write(reinterpret_cast<const char *>(bits.data()), bits.size());
+		}
+
+		inline cv::Mat readMask(std::istream &in) {
+			int32_t rows, cols;
+			readValue(in, rows);
+			readValue(in, cols);
+			if (rows < 0 || cols < 0) throw std::runtime_error("Invalid mask in checkpoint.");
+			if ((uint64_t(rows) * cols + 7) / 8 > remainingBytes(in)) throw std::runtime_error("Truncated checkpoint.");
+			std::vector<unsigned char> bits((size_t(rows) * cols + 7) / 8);
+			in.read(reinterpret_cast<char *>(bits.data()), bits.size());
+			if (!in) throw std::runtime_error("Truncated checkpoint.");
+			cv::Mat mask(rows, cols, CV_8UC1);
+			size_t k = 0;
+			for (int i = 0; i < rows; ++i) {
+				unsigned char *m = mask.ptr<unsigned char>(i);
+				for (int j = 0; j < cols; ++j, ++k) {
+					m[j] = (bits[k / 8] >> (k % 8)) & 1;
+				}
+			}
+			return mask;
+		}
+	}
+
+
+	// writes to a temporary file first and then renames it over filename, so an
+	// interrupted write never replaces a good checkpoint
+	// the parts that don't change during a run (patch size, example sizes,
+	// feature patches and targets) are taken from analysis, the rest from c
+	inline void writeCheckpoint(const std::string &filename, const checkpoint &c, const checkpoint &analysis) {
+		using namespace std;
+		using namespace detail;
+
+		profile::scope prof("checkpoint.write");
+
+		const string temporary = filename + ".tmp";
+		{
+			ofstream out(temporary, ios::binary | ios::trunc);
+			if (!out) {
+				cerr << "Failed to open checkpoint for writing : " << temporary << endl;
+				throw runtime_error("Failed to open checkpoint for writing.");
+			}
+
+			out.write(checkpointMagic, sizeof(checkpointMagic));
+			writeValue(out, checkpointVersion);
+			writeValue(out, int32_t(c.phase));
+			writeValue(out, int32_t(analysis.patchsize));
+			writeValue(out, uint64_t(analysis.exampleSizes.size()));
+			for (const cv::Size &size : analysis.exampleSizes) {
+				writeValue(out, int32_t(size.width));
+				writeValue(out, int32_t(size.height));
+			}
+			writeMat(out, c.synthesis);
+
+			writePatches(out, analysis.featurepatches);
+			writePatches(out, analysis.featuretargets);
+			writeVector(out, c.pendingFeatures);
+
+			writeValue(out, int32_t(c.nonfeatureOffset));
+			writeVector(out, c.nonfeatureDone);
+
+			writeValue(out, uint64_t(c.placements.size()));
+			for (const placementrecord &p : c.placements) {
+				writeValue(out, int32_t(p.phase));
+				writeValue(out, p.position);
+				writeMask(out, p.graphcut);
+			}
+
+			writeMat(out, c.provenanceCoords);
+			writeMat(out, c.provenanceIds);
+			writeMat(out, c.provenanceExamples);
+
+			out.flush();
+			if (!out) {
+				cerr << "Failed to write checkpoint : " << temporary << endl;
+				throw runtime_error("Failed to write checkpoint.");
+			}
+		}
+
+#ifdef _WIN32
+		// (rename doesn't replace an existing file on windows)
+		remove(filename.c_str());
+#endif
+		if (rename(temporary.c_str(), filename.c_str()) != 0) {
+			cerr << "Failed to rename checkpoint : " << temporary << endl;
+			throw runtime_error("Failed to rename checkpoint.");
+		}
+	}
+
+	inline void writeCheckpoint(const std::string &filename, const checkpoint &c) {
+		writeCheckpoint(filename, c, c);
+	}
+
+
+	inline checkpoint readCheckpoint(const std::string &filename) {
+		using namespace std;
+		using namespace detail;
+
+		profile::scope prof("checkpoint.read");
+
+		ifstream in(filename, ios::binary);
+		if (!in) {
+			cerr << "File not found : " << filename << endl;
+			throw runtime_error("File not found");
+		}
+
+		char magic[sizeof(checkpointMagic)];
+		uint32_t version;
+		in.read(magic, sizeof(magic));
+		readValue(in, version);
+		if (!equal(magic, magic + sizeof(magic), checkpointMagic) || version != checkpointVersion) {
+			cerr << "Invalid checkpoint (or version " << version << ") : " << filename << endl;
+			throw runtime_error("Invalid checkpoint.");
+		}
+
+		checkpoint c;
+		int32_t v;
+		readValue(in, v); c.phase = v;
+		readValue(in, v); c.patchsize = v;
+		uint64_t n = readCount(in, 2 * sizeof(int32_t));
+		c.exampleSizes.resize(n);
+		for (cv::Size &size : c.exampleSizes) {
+			readValue(in, v); size.width = v;
+			readValue(in, v); size.height = v;
+		}
+		c.synthesis = readMat(in);
+
+		readPatches(in, c.featurepatches);
+		readPatches(in, c.featuretargets);
+		readVector(in, c.pendingFeatures);
+
+		readValue(in, v); c.nonfeatureOffset = v;
+		readVector(in, c.nonfeatureDone);
+
+		// phase, position and mask size
+		n = readCount(in, sizeof(int32_t) + sizeof(cv::Vec2i) + 2 * sizeof(int32_t));
+		c.placements.resize(n);
+		for (placementrecord &p : c.placements) {
+			readValue(in, v); p.phase = v;
+			readValue(in, p.position);
+			p.graphcut = readMask(in);
+		}
+
+		c.provenanceCoords = readMat(in);
+		c.provenanceIds = readMat(in);
+		c.provenanceExamples = readMat(in);
+		return c;
+	}
+
+
+	// Writes checkpoints on a background thread, at most once per interval
+	//
+	// The parts of the checkpoint that don't change during a run are handed
+	// over once (setAnalysis) and shared by every write. Each snapshot then only
+	// holds the state of the run (the synthesis and provenance must be copies,
+	// the graphcut masks are never modified once placed so they can be shared).
+	// A snapshot offered while the previous write is still running is dropped
+	// rather than stalling the synthesis, except for the final one.
+	class checkpointwriter {
+	private:
+		std::string m_filename;
+		std::chrono::steady_clock::duration m_interval;
+		std::chrono::steady_clock::time_point m_last;
+		std::future<void> m_pending;
+		std::shared_ptr<const checkpoint> m_analysis;
+
+		bool busy() const {
+			return m_pending.valid() && m_pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+		}
+
+		// reports (but doesn't rethrow) a failed write, a checkpoint is never worth
+		// losing the synthesis for
+		void collect() {
+			if (!m_pending.valid()) return;
+			try {
+				m_pending.get();
+			}
+			catch (std::exception &e) {
+				std::cerr << "Checkpoint not written : " << e.what() << std::endl;
+			}
+		}
+
+	public:
+		checkpointwriter() { }
+
+		// an empty filename disables checkpoints
+		checkpointwriter(const std::string &filename, double intervalSeconds)
+			: m_filename(filename),
+			m_interval(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(intervalSeconds))),
+			m_last(std::chrono::steady_clock::now())
+		{ }
+
+		checkpointwriter(const checkpointwriter &) = delete;
+		checkpointwriter & operator=(const checkpointwriter &) = delete;
+
+		~checkpointwriter() {
+			collect();
+		}
+
+		bool enabled() const { return !m_filename.empty(); }
+
+		// patch size, example sizes, feature patches and targets of the run
+		void setAnalysis(checkpoint analysis) {
+			if (!enabled()) return;
+			collect();
+			m_analysis = std::make_shared<const checkpoint>(std::move(analysis));
+		}
+
+		// whether a snapshot should be taken now
+		bool due() const {
+			return enabled() && !busy() && std::chrono::steady_clock::now() - m_last >= m_interval;
+		}
+
+		void write(checkpoint c) {
+			if (!enabled() || busy()) return;
+			collect();
+			m_last = std::chrono::steady_clock::now();
+			std::string filename = m_filename;
+			std::shared_ptr<const checkpoint> analysis = m_analysis;
+			m_pending = std::async(std::launch::async, [filename, analysis](checkpoint c) {
+				writeCheckpoint(filename, c, analysis ? *analysis : c);
+			}, std::move(c));
+		}
+
+		// writes the snapshot after any write in progress, and waits for it
+		void finish(checkpoint c) {
+			if (!enabled()) return;
+			collect();
+			try {
+				writeCheckpoint(m_filename, c, m_analysis ? *m_analysis : c);
+			}
+			catch (std::exception &e) {
+				std::cerr << "Checkpoint not written : " << e.what() << std::endl;
+			}
+			m_last = std::chrono::steady_clock::now();
+		}
+	};
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+// std
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+// opencv
+#include <opencv2/core.hpp>
+
+
+namespace zhou {
+
+	// Tracks which pixels of the synthesis are valid (not NaN) and answers how
+	// many pixels of any window are covered, without rescanning the window
+	//
+	// Counts are kept in a 2D Fenwick tree (a summed-area table that supports
+	// point updates) so both a window query and marking a pixel as covered cost
+	// O(log(rows) * log(cols)). Building the tree is linear in the canvas size
+	// and only happens once, after that only the area of each placement is
+	// scanned for newly covered pixels.
+	class coveragemap {
+	private:
+		int m_rows = 0, m_cols = 0;
+		cv::Mat m_valid;            // CV_8UC1, 1 where the synthesis is valid
+		std::vector<int> m_tree;    // row-major Fenwick tree over m_valid
+
+		int & node(int i, int j) { return m_tree[size_t(i) * m_cols + j]; }
+		int node(int i, int j) const { return m_tree[size_t(i) * m_cols + j]; }
+
+		// number of valid pixels in [0, i) x [0, j)
+		int prefix(int i, int j) const {
+			int s = 0;
+			for (int r = i - 1; r >= 0; r = (r & (r + 1)) - 1) {
+				for (int c = j - 1; c >= 0; c = (c & (c + 1)) - 1) {
+					s += node(r, c);
+				}
+			}
+			return s;
+		}
+
+		void add(int i, int j, int d) {
+			for (int r = i; r < m_rows; r |= r + 1) {
+				for (int c = j; c < m_cols; c |= c + 1) {
+					node(r, c) += d;
+				}
+			}
+		}
+
+	public:
+		coveragemap() { }
+
+		explicit coveragemap(const cv::Mat synthesis) : m_rows(synthesis.rows), m_cols(synthesis.cols) {
+			assert(synthesis.type() == CV_32FC1);
+
+			using namespace cv;
+			using namespace std;
+
+			m_valid = Mat(m_rows, m_cols, CV_8UC1);
+			m_tree.assign(size_t(m_rows) * m_cols, 0);
+			for (int i = 0; i < m_rows; ++i) {
+				const float *s = synthesis.ptr<float>(i);
+				uchar *v = m_valid.ptr<uchar>(i);
+				int *t = &node(i, 0);
+				for (int j = 0; j < m_cols; ++j) {
+					v[j] = !isnan(s[j]);
+					t[j] = v[j];
+				}
+				// push partial sums along the row
+				for (int j = 0; j < m_cols; ++j) {
+					int k = j | (j + 1);
+					if (k < m_cols) t[k] += t[j];
+				}
+			}
+			// then down the columns
+			for (int i = 0; i < m_rows; ++i) {
+				int k = i | (i + 1);
+				if (k >= m_rows) continue;
+				const int *src = &node(i, 0);
+				int *dst = &node(k, 0);
+				for (int j = 0; j < m_cols; ++j) {
+					dst[j] += src[j];
+				}
+			}
+		}
+
+		cv::Size size() const { return cv::Size(m_cols, m_rows); }
+
+		// number of valid pixels in the window, area outside the canvas is never covered
+		int covered(cv::Rect window) const {
+			cv::Rect r = window & cv::Rect(0, 0, m_cols, m_rows);
+			if (r.empty()) return 0;
+			return prefix(r.y + r.height, r.x + r.width) - prefix(r.y, r.x + r.width)
+				- prefix(r.y + r.height, r.x) + prefix(r.y, r.x);
+		}
+
+		// number of pixels in the window that are still to be synthesized
+		int uncovered(cv::Rect window) const {
+			return window.area() - covered(window);
+		}
+
+		// marks pixels in the window that have become valid in the synthesis
+		// returns the number of newly covered pixels
+		int update(const cv::Mat synthesis, cv::Rect window) {
+			assert(synthesis.type() == CV_32FC1);
+			assert(synthesis.rows == m_rows && synthesis.cols == m_cols);
+
+			using namespace cv;
+			using namespace std;
+
+			Rect r = window & Rect(0, 0, m_cols, m_rows);
+			int added = 0;
+			for (int i = r.y; i < r.y + r.height; ++i) {
+				const float *s = synthesis.ptr<float>(i);
+				uchar *v = m_valid.ptr<uchar>(i);
+				for (int j = r.x; j < r.x + r.width; ++j) {
+					if (!v[j] && !isnan(s[j])) {
+						v[j] = 1;
+						add(i, j, 1);
+						added++;
+					}
+				}
+			}
+			return added;
+		}
+	};
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 // std
+#include <cmath>
+#include <limits>
 #include <unordered_set>
 #include <queue>
 #include <vector>
@@ -17,9 +19,64 @@ namespace zhou {
 	struct fpatch {
 		cv::Vec2f center; // center relative to the original data
 		std::vector<cv::Vec2f> controlpoints; // outgoing points relative to the center (but does not contain the center)
+		float safeRadius = -1; // any sample this close to the center is inside the example (negative if unknown)
+		int example = 0; // index of the example the patch is from (see examplelibrary)
 	};
 
 
+	// result of checking whether a patch can be sampled from the example
+	enum {
+		PATCH_FEASIBLE,
+		PATCH_INFEASIBLE,
+		PATCH_FEASIBILITY_UNKNOWN // too close to the border to tell, the samples have to be checked
+	};
+
+
+	// sets the safe radius of each patch for an example of the given size
+	// a bilinear sample needs both of its neighbours inside the example, the
+	// half pixel margin leaves room for the fixed point rounding of remap
+	inline void computeSafeRadius(std::vector<fpatch> &patches, cv::Size example) {
+		using namespace std;
+		for (fpatch &fp : patches) {
+			fp.safeRadius = min(min(fp.center[0] - 0.5f, fp.center[1] - 0.5f), min(example.width - 1.5f - fp.center[0], example.height - 1.5f - fp.center[1]));
+		}
+	}
+
+
+	// whether sampling the example at center + R(angle) (p - size / 2), for every
+	// pixel p of a size x size patch, stays inside the example, decided from the
+	// corners of the patch without sampling anything
+	inline int rotatedPatchFeasibility(const fpatch &fp, float angle, int size, cv::Size example) {
+		using namespace cv;
+		using namespace std;
+
+		const float lo = -float(size / 2), hi = float(size - 1 - size / 2);
+
+		// no rotation can reach outside the safe radius
+		if (fp.safeRadius >= 0 && fp.safeRadius >= sqrt(2.f) * max(-lo, hi)) return PATCH_FEASIBLE;
+
+		// the samples are an affine grid, so the extremes are at the corners
+		const float c = cos(angle), s = sin(angle);
+		Vec2f bmin(numeric_limits<float>::infinity(), numeric_limits<float>::infinity()), bmax = -bmin;
+		for (float y : { lo, hi }) {
+			for (float x : { lo, hi }) {
+				Vec2f q = fp.center + Vec2f(c * x - s * y, s * x + c * y);
+				bmin = Vec2f(min(bmin[0], q[0]), min(bmin[1], q[1]));
+				bmax = Vec2f(max(bmax[0], q[0]), max(bmax[1], q[1]));
+			}
+		}
+
+		// a sample more than half a pixel outside always touches a missing pixel
+		if (bmin[0] < -0.5f || bmin[1] < -0.5f || bmax[0] > example.width - 0.5f || bmax[1] > example.height - 0.5f) {
+			return PATCH_INFEASIBLE;
+		}
+		if (bmin[0] >= 0.5f && bmin[1] >= 0.5f && bmax[0] <= example.width - 1.5f && bmax[1] <= example.height - 1.5f) {
+			return PATCH_FEASIBLE;
+		}
+		return PATCH_FEASIBILITY_UNKNOWN;
+	}
+
+
 	inline bool circleLineIntersection(cv::Vec2f center, float radius, cv::Vec2f start, cv::Vec2f end, cv::Vec2f &out) {
 		cv::Vec2f d = end - start; // direction
 		cv::Vec2f f = start - center; // distance to center
@@ -47,11 +104,37 @@ namespace zhou {
 	}
 
 
+	// read-only view of (part of) a path, forwards or backwards, without copying it
+	struct pathspan {
+		const cv::Vec2f *first = nullptr;
+		int count = 0;
+		bool reversed = false;
+
+		pathspan() { }
+
+		// the points [begin, end) of path
+		pathspan(const std::vector<cv::Vec2f> &path, int begin, int end, bool reversed_ = false)
+			: first(path.data() + begin), count(end - begin), reversed(reversed_)
+		{
+			assert(0 <= begin && begin <= end && end <= int(path.size()));
+		}
+
+		explicit pathspan(const std::vector<cv::Vec2f> &path, bool reversed_ = false)
+			: pathspan(path, 0, int(path.size()), reversed_)
+		{ }
+
+		int size() const { return count; }
+		bool empty() const { return count == 0; }
+		const cv::Vec2f & operator[](int i) const { return reversed ? first[count - 1 - i] : first[i]; }
+		const cv::Vec2f & back() const { return (*this)[count - 1]; }
+	};
+
+
 	// helper method that returns the first point a path crosses the circle
 	// returns false if there is none
-	inline bool circlePathIntersection(cv::Vec2f center, float radius, std::vector<cv::Vec2f> path, bool reversePath, bool extend, cv::Vec2f &out_intersection) {
-		if (reversePath) reverse(path.begin(), path.end());
-
+	// the path must start inside the circle, so the search only ever visits the
+	// segments up to where the path first leaves it
+	inline bool circlePathIntersection(cv::Vec2f center, float radius, const pathspan &path, bool extend, cv::Vec2f &out_intersection) {
 		assert(!path.empty());
 		assert(radius > 0);
 		assert(norm(center, path[0]) < radius);
@@ -59,7 +142,7 @@ namespace zhou {
 		using namespace cv;
 		using namespace std;
 
-		for (int i = 0; i < path.size() - 1; ++i) {
+		for (int i = 0; i + 1 < path.size(); ++i) {
 			if (circleLineIntersection(center, radius, path[i], path[i + 1], out_intersection)) {
 				return true;
 			}
@@ -68,7 +151,7 @@ namespace zhou {
 		if (extend) {
 
 			// no intersection found, so extend the path from the center to the last point and beyond
-			Vec2f start = path[path.size() - 1];
+			Vec2f start = path.back();
 			Vec2f d = start - center;
 			double n = norm(d);
 			if (n > 0) d *= 2 * radius / n;
@@ -85,18 +168,20 @@ namespace zhou {
 	}
 
 
+	inline bool circlePathIntersection(cv::Vec2f center, float radius, const std::vector<cv::Vec2f> &path, bool reversePath, bool extend, cv::Vec2f &out_intersection) {
+		return circlePathIntersection(center, radius, pathspan(path, reversePath), extend, out_intersection);
+	}
+
+
 
-	// process the node "current" that came from "parent", trying to return the point any edges leave the "center radius"
-	inline std::vector<cv::Vec2f> proccessNode(const ppa::FeatureGraph &features, cv::Vec2f center, float radius, int parent, int current) {
+	// process the node "current" that came from "parent", adding the points any edges leave the "center radius" to intersections
+	inline void proccessNode(const ppa::FeatureGraph &features, cv::Vec2f center, float radius, int parent, int current, std::vector<cv::Vec2f> &intersections) {
 
 		assert(norm(center, features.nodes().at(current).p) < radius);
 
 		using namespace cv;
 		using namespace std;
 
-
-		vector<Vec2f> intersections;
-
 		for (int edgeid : features.nodes().at(current).edges) {
 			// dont processes edge that contains parent
 			const ppa::FeatureEdge &edge = features.edges().at(edgeid);
@@ -104,17 +189,22 @@ namespace zhou {
 
 			// check outgoing edge for intersection
 			Vec2f intersection;
-			if (circlePathIntersection(center, radius, edge.path, (edge.node_start != current), false, intersection)) {
+			if (circlePathIntersection(center, radius, pathspan(edge.path, edge.node_start != current), false, intersection)) {
 				intersections.push_back(intersection - center);
 			}
 
 			// otherwise recursively serch for intersections along the graph
 			else {
-				vector<Vec2f> p = proccessNode(features, center, radius, current, edge.other(current));
-				intersections.insert(intersections.end(), p.begin(), p.end());
+				proccessNode(features, center, radius, current, edge.other(current), intersections);
 			}
 		}
+	}
+
 
+	// process the node "current" that came from "parent", trying to return the point any edges leave the "center radius"
+	inline std::vector<cv::Vec2f> proccessNode(const ppa::FeatureGraph &features, cv::Vec2f center, float radius, int parent, int current) {
+		std::vector<cv::Vec2f> intersections;
+		proccessNode(features, center, radius, parent, current, intersections);
 		return intersections;
 	}
 
@@ -151,7 +241,8 @@ namespace zhou {
 
 				// end-features and branch features
 				//
-				std::vector<Vec2f> controlpoints = proccessNode(features, p, radius, -1, nodeid);
+				std::vector<Vec2f> controlpoints;
+				proccessNode(features, p, radius, -1, nodeid, controlpoints);
 				if (!controlpoints.empty()) {
 					featurepatches.push_back(fpatch{ p, controlpoints });
 				}
@@ -165,18 +256,16 @@ namespace zhou {
 
 					// path-features
 					//
-					vector<Vec2f> previousPath; // reverse order
-					vector<Vec2f> nextPath = edge.path;
-					// traverse edge with the path before and patch after
-					previousPath.push_back(nextPath.back());
-					nextPath.pop_back();
+					// traverse edge from its back, with the path before the center
+					// (back to where the traversal started) and the path after it
+					// (on to the front) as views of the edge's path
+					const vector<Vec2f> &path = edge.path;
 					float distance = 0;
 
 					// while there is a line segment to traverse
-					while (nextPath.size() >= 2) {
-						Vec2f center = nextPath.back();
-						distance += norm(previousPath.back(), center);
-						previousPath.push_back(center);
+					for (int k = int(path.size()) - 2; k >= 1; --k) {
+						Vec2f center = path[k];
+						distance += norm(path[k + 1], center);
 
 						// progress in steps of size "radius"
 						if (distance > radius) {
@@ -185,13 +274,12 @@ namespace zhou {
 							// create patch here
 							vector<Vec2f> controlpoints;
 							Vec2f point;
-							circlePathIntersection(center, radius, previousPath, true, true, point);
+							circlePathIntersection(center, radius, pathspan(path, k, int(path.size())), true, point);
 							controlpoints.push_back(point - center);
-							circlePathIntersection(center, radius, nextPath, true, true, point);
+							circlePathIntersection(center, radius, pathspan(path, 0, k + 1, true), true, point);
 							controlpoints.push_back(point - center);
 							featurepatches.push_back(fpatch{ center, controlpoints });
 						}
-						nextPath.pop_back();
 					}
 					// 
 					// path-features
@@ -204,7 +292,8 @@ namespace zhou {
 	}
 
 	
-	inline std::vector<cv::Mat> extractNonfeaturePatches(cv::Mat examplemap, std::vector<fpatch> featurePatches, int patch_size) {
+	// origins (if given) receives the topleft of each patch in the example
+	inline std::vector<cv::Mat> extractNonfeaturePatches(cv::Mat examplemap, std::vector<fpatch> featurePatches, int patch_size, std::vector<cv::Point> *origins = nullptr) {
 		assert(patch_size > 1);
 		assert(!examplemap.empty());
 		assert(examplemap.type() == CV_32FC1);
@@ -232,6 +321,7 @@ namespace zhou {
 			for (int j = 0; j < mask.cols - patch_size; j += patch_size / 2) {
 				if (!mask.at<bool>(i + hp1, j + hp1)) {
 					nonfeaturePatches.push_back(examplemap(Range(i, i + patch_size), Range(j, j + patch_size)));
+					if (origins) origins->push_back(Point(j, i));
 				}
 			}
 		}
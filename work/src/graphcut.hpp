@@ -2,6 +2,7 @@
 
 // std
 #include <iostream>
+#include <memory>
 
 // maxflow
 #include <maxflow/graph.h>
@@ -9,6 +10,11 @@
 // opencv
 #include <opencv2/core.hpp>
 
+// project
+#include "arena.hpp"
+#include "profile.hpp"
+#include "kernels.hpp"
+
 namespace zhou {
 
 	inline void print_graphcut_error(const char *c) {
@@ -17,7 +23,10 @@ namespace zhou {
 
 	// the synthesis is a patch sized segment of the terrain synthesis that the patch will be placed on
 	// the patch itself must not have any NaN values
-	// returns a mask of the cut
+	// returns a mask of the cut (a scratchMat, see arena.hpp)
+	// cost receives the cost of the cut (0 if there is nothing to cut)
+	// the graph is kept per thread and reset for the next cut, so cuts of the
+	// same size only allocate the storage for it once
 	inline cv::Mat graphcut(cv::Mat synthesis, cv::Mat patch, float *cost = nullptr) {
 		using FloatGraph_t = Graph<float, float, float>;
 		using namespace std;
@@ -27,20 +36,30 @@ namespace zhou {
 		assert(synthesis.type() == CV_32FC1);
 		assert(patch.type() == CV_32FC1);
 
+		profile::scope prof("graphcut");
+
 		// create graphcut patch, graph and array
 		const float max_edge = 1e10; // numeric_limits<float>::max();
-		Mat patch_cut(synthesis.rows, synthesis.cols, CV_8UC1, true);
-		Mat area_id(synthesis.rows, synthesis.cols, CV_32SC1, Scalar(-1)); // stores node ids for each point
-		FloatGraph_t graph(synthesis.cols * synthesis.rows, synthesis.cols * synthesis.rows * 4, print_graphcut_error);
-		
-		Mat ids(synthesis.rows, synthesis.cols, CV_8UC3, Scalar(0, 0, 0));
-		Mat debug(synthesis.rows, synthesis.cols, CV_8UC3, Scalar(0, 0, 0));
+		Mat patch_cut = scratchMat(synthesis.rows, synthesis.cols, CV_8UC1, Scalar(1));
+		Mat area_id = scratchMat(synthesis.rows, synthesis.cols, CV_32SC1, Scalar(-1)); // stores node ids for each point
+
+		thread_local unique_ptr<FloatGraph_t> cached_graph;
+		thread_local int cached_nodes = 0;
+		int nodes = synthesis.cols * synthesis.rows;
+		if (!cached_graph || cached_nodes < nodes) {
+			cached_graph.reset(new FloatGraph_t(nodes, nodes * 4, print_graphcut_error));
+			cached_nodes = nodes;
+		}
+		else {
+			cached_graph->reset();
+		}
+		FloatGraph_t &graph = *cached_graph;
+
 
 		// generate nodes for every (non-NaN) point
 		for (int i = 0; i < synthesis.rows; ++i) {
 			for (int j = 0; j < synthesis.cols; ++j) {
 				if (!isnan(synthesis.at<float>(i, j))) {
-					ids.at<Vec3b>(i, j) = Vec3b(0, 0, 255);
 					area_id.at<int>(i, j) = graph.add_node();
 				}
 			}
@@ -55,7 +74,10 @@ namespace zhou {
 
 		// connect nodes
 		Rect area(Point(0, 0), synthesis.size());
-		Mat diff = abs(synthesis - patch);
+		Mat diff = scratchMat(synthesis.rows, synthesis.cols, CV_32FC1);
+		for (int i = 0; i < synthesis.rows; ++i) {
+			kernels::absDiff(synthesis.ptr<float>(i), patch.ptr<float>(i), diff.ptr<float>(i), synthesis.cols);
+		}
 		for (int i = 0; i < synthesis.rows; ++i) {
 			for (int j = 0; j < synthesis.cols; ++j) {
 				Point p(j, i);
@@ -95,12 +117,10 @@ namespace zhou {
 
 					// connect to one of, source or sink
 					if (in_source) {
-						ids.at<Vec3b>(p) = Vec3b(255, 0, 0);
 						graph.add_tweights(area_id.at<int>(p), max_edge, 0);
 						++source_count;
 					}
 					else if (in_sink) {
-						ids.at<Vec3b>(p) = Vec3b(0, 255, 0);
 						graph.add_tweights(area_id.at<int>(p), 0, max_edge);
 						++sink_count;
 					}
@@ -111,16 +131,27 @@ namespace zhou {
 			}
 		}
 
-		//imwrite("output/ids.png", ids);
-
+		if (profile::enabled()) {
+			profile::counter("graphcut.nodes", graph.get_node_num());
+			profile::counter("graphcut.edges", graph.get_arc_num() / 2);
+			// size of the per-pixel temporaries (an estimate of the working set,
+			// they come from the scratch arena, see scratch.growth for real
+			// allocations; graph storage is internal to maxflow)
+			profile::counter("graphcut.workingset", double(synthesis.total()) * (patch_cut.elemSize() + area_id.elemSize() + diff.elemSize()));
+		}
 
 		// if there are no sources or no sinks we return the patch as is
 		if (source_count == 0 || sink_count == 0) {
+			if (cost != nullptr) *cost = 0;
 			return patch_cut;
 		}
 
 		// compute the maxflow/mincut
-		float c = graph.maxflow();
+		float c;
+		{
+			profile::scope prof_maxflow("graphcut.maxflow");
+			c = graph.maxflow();
+		}
 		if (cost != nullptr) {
 			*cost = c;
 		}
@@ -132,40 +163,34 @@ namespace zhou {
 				int id = area_id.at<int>(p);
 				// if there was no node or connected to the source
 				patch_cut.at<uchar>(p) = !(id >= 0 && graph.what_segment(id) == FloatGraph_t::SOURCE);
-
-				if (id >= 0) {
-					debug.at<Vec3b>(p) = Vec3b(0, 0, 255);
-					if (graph.what_segment(id) == FloatGraph_t::SOURCE)
-						debug.at<Vec3b>(p) = Vec3b(255, 0, 0);
-					if (graph.what_segment(id) == FloatGraph_t::SINK)
-						debug.at<Vec3b>(p) = Vec3b(0, 255, 0);
-				}
 			}
 		}
 
-		//imwrite("output/debug.png", debug);
 		//imwrite("output/diff.png", diff);
 
 		return patch_cut;
 	}
 
 
-	// returns a mask of the cut relative to the patch size
+	// returns a mask of the cut relative to the patch size (a scratchMat)
+	// only the window of the synthesis under the patch is read
 	inline cv::Mat graphcut(cv::Mat synthesis, cv::Mat patch, cv::Vec2i pos, float *cost = nullptr) {
 		using namespace std;
 		using namespace cv;
 
 		assert(synthesis.type() == CV_32FC1);
 		assert(patch.type() == CV_32FC1);
-		
-		Mat bsynthesis;
-		copyMakeBorder(synthesis, bsynthesis, patch.rows, patch.rows, patch.cols, patch.cols, BORDER_CONSTANT, numeric_limits<double>::quiet_NaN());
 
-		//imwrite("output/isnan.png", bsynthesis);
+		profile::scope prof("graphcut.border");
 
-		int startcol = pos[0] + patch.cols;
-		int startrow = pos[1] + patch.rows;
-		Mat synthesis_patch = bsynthesis(Range(startrow, startrow + patch.rows), Range(startcol, startcol + patch.cols));
+		// copy out the window under the patch, NaN outside of the synthesis
+		Rect window(Point(pos[0], pos[1]), patch.size());
+		Rect inside = window & Rect(Point(0, 0), synthesis.size());
+		Mat synthesis_patch = scratchMat(patch.rows, patch.cols, CV_32FC1, Scalar(numeric_limits<float>::quiet_NaN()));
+		if (!inside.empty()) {
+			synthesis(inside).copyTo(synthesis_patch(inside - window.tl()));
+		}
+		prof.end();
 
 		return graphcut(synthesis_patch, patch, cost);
 	}
@@ -0,0 +1,334 @@
+
+// std
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+// project
+#include "kernels.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define ZHOU_KERNELS_X86
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+
+namespace zhou {
+	namespace kernels {
+		namespace {
+
+			float scalarMaskedSSD(const float *a, const float *b, size_t n) {
+				float s = 0;
+				for (size_t i = 0; i < n; ++i) {
+					float d = a[i] - b[i];
+					if (!std::isnan(d)) s += d * d;
+				}
+				return s;
+			}
+
+			float scalarMaskedSum(const float *a, size_t n) {
+				float s = 0;
+				for (size_t i = 0; i < n; ++i) {
+					if (!std::isnan(a[i])) s += a[i];
+				}
+				return s;
+			}
+
+			void scalarAbsDiff(const float *a, const float *b, float *out, size_t n) {
+				for (size_t i = 0; i < n; ++i) {
+					out[i] = std::abs(a[i] - b[i]);
+				}
+			}
+
+			size_t scalarNanCount(const float *a, size_t n) {
+				size_t c = 0;
+				for (size_t i = 0; i < n; ++i) {
+					c += std::isnan(a[i]);
+				}
+				return c;
+			}
+
+			float halfToFloat(uint16_t h) {
+				uint32_t sign = uint32_t(h & 0x8000) << 16;
+				uint32_t exponent = (h >> 10) & 0x1f;
+				uint32_t mantissa = h & 0x3ff;
+				uint32_t bits;
+				if (exponent == 0) {
+					if (mantissa == 0) {
+						bits = sign;
+					}
+					else {
+						// subnormal, normalize
+						uint32_t e = 127 - 15 + 1;
+						while (!(mantissa & 0x400)) {
+							mantissa <<= 1;
+							e--;
+						}
+						bits = sign | (e << 23) | ((mantissa & 0x3ff) << 13);
+					}
+				}
+				else if (exponent == 31) {
+					bits = sign | 0x7f800000 | (mantissa << 13);
+				}
+				else {
+					bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+				}
+				float f;
+				std::memcpy(&f, &bits, sizeof(f));
+				return f;
+			}
+
+			uint16_t floatToHalf(float f) {
+				uint32_t bits;
+				std::memcpy(&bits, &f, sizeof(bits));
+				uint16_t sign = uint16_t((bits >> 16) & 0x8000);
+				if ((bits & 0x7fffffff) > 0x7f800000) return sign | 0x7e00; // NaN
+				int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+				uint32_t mantissa = bits & 0x7fffff;
+				if (exponent >= 31) return sign | 0x7c00; // overflow to infinity
+				if (exponent <= 0) {
+					// subnormal (or zero)
+					if (exponent < -10) return sign;
+					mantissa |= 0x800000;
+					int shift = 14 - exponent;
+					uint32_t half = mantissa >> shift;
+					uint32_t rest = mantissa & ((1u << shift) - 1);
+					uint32_t halfway = 1u << (shift - 1);
+					if (rest > halfway || (rest == halfway && (half & 1))) half++;
+					return uint16_t(sign | half);
+				}
+				uint32_t half = (uint32_t(exponent) << 10) | (mantissa >> 13);
+				uint32_t rest = mantissa & 0x1fff;
+				if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++; // may carry into the exponent
+				return uint16_t(sign | half);
+			}
+
+			void scalarDecodeHalf(const uint16_t *a, float *out, size_t n) {
+				for (size_t i = 0; i < n; ++i) {
+					out[i] = halfToFloat(a[i]);
+				}
+			}
+
+			void scalarDecodeInt16(const int16_t *a, float offset, float scale, float *out, size_t n) {
+				for (size_t i = 0; i < n; ++i) {
+					out[i] = a[i] == int16NaN ? NAN : offset + scale * a[i];
+				}
+			}
+
+
+#ifdef ZHOU_KERNELS_X86
+			inline float hsum(__m128 v) {
+				v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+				v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+				return _mm_cvtss_f32(v);
+			}
+
+			float sse2MaskedSSD(const float *a, const float *b, size_t n) {
+				__m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+				size_t i = 0;
+				for (; i + 8 <= n; i += 8) {
+					__m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+					__m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+					d0 = _mm_and_ps(d0, _mm_cmpord_ps(d0, d0));
+					d1 = _mm_and_ps(d1, _mm_cmpord_ps(d1, d1));
+					acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+					acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+				}
+				float s = hsum(_mm_add_ps(acc0, acc1));
+				return s + scalarMaskedSSD(a + i, b + i, n - i);
+			}
+
+			float sse2MaskedSum(const float *a, size_t n) {
+				__m128 acc = _mm_setzero_ps();
+				size_t i = 0;
+				for (; i + 4 <= n; i += 4) {
+					__m128 v = _mm_loadu_ps(a + i);
+					acc = _mm_add_ps(acc, _mm_and_ps(v, _mm_cmpord_ps(v, v)));
+				}
+				return hsum(acc) + scalarMaskedSum(a + i, n - i);
+			}
+
+			void sse2AbsDiff(const float *a, const float *b, float *out, size_t n) {
+				const __m128 sign = _mm_set1_ps(-0.f);
+				size_t i = 0;
+				for (; i + 4 <= n; i += 4) {
+					__m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+					_mm_storeu_ps(out + i, _mm_andnot_ps(sign, d));
+				}
+				scalarAbsDiff(a + i, b + i, out + i, n - i);
+			}
+
+			size_t sse2NanCount(const float *a, size_t n) {
+				static const int bits[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+				size_t c = 0;
+				size_t i = 0;
+				for (; i + 4 <= n; i += 4) {
+					__m128 v = _mm_loadu_ps(a + i);
+					c += bits[_mm_movemask_ps(_mm_cmpunord_ps(v, v))];
+				}
+				return c + scalarNanCount(a + i, n - i);
+			}
+
+			void sse2DecodeInt16(const int16_t *a, float offset, float scale, float *out, size_t n) {
+				const __m128 vo = _mm_set1_ps(offset), vs = _mm_set1_ps(scale);
+				const __m128 code = _mm_set1_ps(int16NaN), nan = _mm_set1_ps(NAN);
+				auto decode = [&](__m128i q) {
+					__m128 f = _mm_cvtepi32_ps(q);
+					__m128 isnan = _mm_cmpeq_ps(f, code);
+					return _mm_or_ps(_mm_andnot_ps(isnan, _mm_add_ps(vo, _mm_mul_ps(vs, f))), _mm_and_ps(isnan, nan));
+				};
+				size_t i = 0;
+				for (; i + 8 <= n; i += 8) {
+					__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+					// sign extend to 32 bits
+					__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+					__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+					_mm_storeu_ps(out + i, decode(lo));
+					_mm_storeu_ps(out + i + 4, decode(hi));
+				}
+				scalarDecodeInt16(a + i, offset, scale, out + i, n - i);
+			}
+#endif
+
+
+#if defined(ZHOU_KERNELS_X86) && !defined(_MSC_VER)
+			// __builtin_cpu_supports has no f16c query on older compilers
+			bool cpuHasF16C() {
+				unsigned a, b, c, d;
+				__asm__ __volatile__("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(1), "c"(0));
+				return (c & (1u << 29)) != 0;
+			}
+#endif
+
+			bool cpuSupports(const char *name) {
+#if defined(ZHOU_KERNELS_X86) && defined(_MSC_VER)
+				int info[4];
+				__cpuid(info, 0);
+				int ids = info[0];
+				if (ids < 7) return false;
+				__cpuid(info, 1);
+				bool osxsave = (info[2] & (1 << 27)) != 0;
+				bool fma = (info[2] & (1 << 12)) != 0;
+				bool f16c = (info[2] & (1 << 29)) != 0;
+				if (!osxsave) return false;
+				unsigned long long xcr0 = _xgetbv(0);
+				__cpuidex(info, 7, 0);
+				if (std::strcmp(name, "avx2") == 0) {
+					return fma && f16c && (info[1] & (1 << 5)) && (xcr0 & 0x6) == 0x6;
+				}
+				if (std::strcmp(name, "avx512") == 0) {
+					return (info[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6;
+				}
+				return false;
+#elif defined(ZHOU_KERNELS_X86)
+				__builtin_cpu_init();
+				if (std::strcmp(name, "avx2") == 0) {
+					return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && cpuHasF16C();
+				}
+				if (std::strcmp(name, "avx512") == 0) {
+					return __builtin_cpu_supports("avx512f");
+				}
+				return false;
+#else
+				(void)name;
+				return false;
+#endif
+			}
+
+			const detail::table & select() {
+				const detail::table *best = detail::scalarTable();
+				if (const detail::table *t = detail::sse2Table()) best = t;
+				if (cpuSupports("avx2")) {
+					if (const detail::table *t = detail::avx2Table()) best = t;
+				}
+				if (cpuSupports("avx512")) {
+					if (const detail::table *t = detail::avx512Table()) best = t;
+				}
+
+				// override (can only select variants that are available)
+				if (const char *env = std::getenv("ZHOU_SIMD")) {
+					const detail::table *candidates[] = { detail::scalarTable(), detail::sse2Table(), detail::avx2Table(), detail::avx512Table() };
+					bool found = false;
+					for (const detail::table *t : candidates) {
+						if (t && std::strcmp(env, t->name) == 0) {
+							bool supported = t == detail::scalarTable() || t == detail::sse2Table()
+								|| (t == detail::avx2Table() && cpuSupports("avx2"))
+								|| (t == detail::avx512Table() && cpuSupports("avx512"));
+							if (supported) {
+								best = t;
+								found = true;
+							}
+						}
+					}
+					if (!found) {
+						std::cerr << "ZHOU_SIMD=" << env << " is not available, using " << best->name << std::endl;
+					}
+				}
+				return *best;
+			}
+
+			const detail::table & active() {
+				static const detail::table &t = select();
+				return t;
+			}
+		}
+
+
+		namespace detail {
+
+			const table * scalarTable() {
+				static const table t = { "scalar", scalarMaskedSSD, scalarMaskedSum, scalarAbsDiff, scalarNanCount, scalarDecodeHalf, scalarDecodeInt16 };
+				return &t;
+			}
+
+			const table * sse2Table() {
+#ifdef ZHOU_KERNELS_X86
+				// (no half precision conversion instructions before F16C)
+				static const table t = { "sse2", sse2MaskedSSD, sse2MaskedSum, sse2AbsDiff, sse2NanCount, scalarDecodeHalf, sse2DecodeInt16 };
+				return &t;
+#else
+				return nullptr;
+#endif
+			}
+		}
+
+
+		float maskedSSD(const float *a, const float *b, size_t n) {
+			return active().maskedSSD(a, b, n);
+		}
+
+		float maskedSum(const float *a, size_t n) {
+			return active().maskedSum(a, n);
+		}
+
+		void absDiff(const float *a, const float *b, float *out, size_t n) {
+			active().absDiff(a, b, out, n);
+		}
+
+		size_t nanCount(const float *a, size_t n) {
+			return active().nanCount(a, n);
+		}
+
+		void decodeHalf(const uint16_t *a, float *out, size_t n) {
+			active().decodeHalf(a, out, n);
+		}
+
+		void decodeInt16(const int16_t *a, float offset, float scale, float *out, size_t n) {
+			active().decodeInt16(a, offset, scale, out, n);
+		}
+
+		void encodeHalf(const float *a, uint16_t *out, size_t n) {
+			for (size_t i = 0; i < n; ++i) {
+				out[i] = floatToHalf(a[i]);
+			}
+		}
+
+		const char * variant() {
+			return active().name;
+		}
+	}
+}
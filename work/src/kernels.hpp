@@ -0,0 +1,68 @@
+#pragma once
+
+// std
+#include <cstddef>
+#include <cstdint>
+
+
+// Vectorized inner loops shared by the synthesis cost functions
+//
+// Each kernel has a scalar, SSE2, AVX2 and AVX-512 implementation (the wider
+// ones live in their own translation units, compiled with the matching
+// instruction set flags). The best variant the CPU supports is chosen the first
+// time a kernel is called, and can be overridden by setting the ZHOU_SIMD
+// environment variable to one of: scalar, sse2, avx2, avx512.
+//
+// Sums are accumulated in lanes, so results can differ in the last bits between
+// variants (but not between runs on the same machine).
+namespace zhou {
+	namespace kernels {
+
+		// sum of (a[i] - b[i])^2 over every i where neither value is NaN
+		float maskedSSD(const float *a, const float *b, size_t n);
+
+		// sum of a[i] over every i where a[i] is not NaN
+		float maskedSum(const float *a, size_t n);
+
+		// out[i] = |a[i] - b[i]| (NaN if either value is NaN)
+		void absDiff(const float *a, const float *b, float *out, size_t n);
+
+		// number of NaN values in a
+		size_t nanCount(const float *a, size_t n);
+
+		// out[i] = float(a[i]) for IEEE half precision a
+		void decodeHalf(const uint16_t *a, float *out, size_t n);
+
+		// code of a NaN value in decodeInt16
+		const int16_t int16NaN = -32768;
+
+		// out[i] = offset + scale * a[i] (NaN where a[i] is int16NaN)
+		void decodeInt16(const int16_t *a, float offset, float scale, float *out, size_t n);
+
+		// out[i] = half(a[i]), rounded to nearest even (not vectorized, for building data)
+		void encodeHalf(const float *a, uint16_t *out, size_t n);
+
+		// name of the variant in use
+		const char * variant();
+
+
+		namespace detail {
+
+			struct table {
+				const char *name;
+				float (*maskedSSD)(const float *, const float *, size_t);
+				float (*maskedSum)(const float *, size_t);
+				void (*absDiff)(const float *, const float *, float *, size_t);
+				size_t (*nanCount)(const float *, size_t);
+				void (*decodeHalf)(const uint16_t *, float *, size_t);
+				void (*decodeInt16)(const int16_t *, float, float, float *, size_t);
+			};
+
+			// variants, those not built for this target return nullptr
+			const table * scalarTable();
+			const table * sse2Table();
+			const table * avx2Table();
+			const table * avx512Table();
+		}
+	}
+}
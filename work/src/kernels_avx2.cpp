@@ -0,0 +1,137 @@
+
+// std
+#include <cmath>
+#include <cstdint>
+
+// project
+#include "kernels.hpp"
+
+// compiled with AVX2, FMA and F16C enabled (see CMakeLists.txt), only called
+// after the CPU has been checked for support
+#if defined(__AVX2__) && ((defined(__FMA__) && defined(__F16C__)) || defined(_MSC_VER))
+#define ZHOU_KERNELS_AVX2
+#include <immintrin.h>
+#endif
+
+
+namespace zhou {
+	namespace kernels {
+
+#ifdef ZHOU_KERNELS_AVX2
+		namespace {
+
+			inline float hsum(__m256 v) {
+				__m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+				s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+				s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+				return _mm_cvtss_f32(s);
+			}
+
+			float avx2MaskedSSD(const float *a, const float *b, size_t n) {
+				__m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+				size_t i = 0;
+				for (; i + 16 <= n; i += 16) {
+					__m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+					__m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+					d0 = _mm256_and_ps(d0, _mm256_cmp_ps(d0, d0, _CMP_ORD_Q));
+					d1 = _mm256_and_ps(d1, _mm256_cmp_ps(d1, d1, _CMP_ORD_Q));
+					acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+					acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+				}
+				for (; i + 8 <= n; i += 8) {
+					__m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+					d = _mm256_and_ps(d, _mm256_cmp_ps(d, d, _CMP_ORD_Q));
+					acc0 = _mm256_fmadd_ps(d, d, acc0);
+				}
+				float s = hsum(_mm256_add_ps(acc0, acc1));
+				for (; i < n; ++i) {
+					float d = a[i] - b[i];
+					if (!std::isnan(d)) s += d * d;
+				}
+				return s;
+			}
+
+			float avx2MaskedSum(const float *a, size_t n) {
+				__m256 acc = _mm256_setzero_ps();
+				size_t i = 0;
+				for (; i + 8 <= n; i += 8) {
+					__m256 v = _mm256_loadu_ps(a + i);
+					acc = _mm256_add_ps(acc, _mm256_and_ps(v, _mm256_cmp_ps(v, v, _CMP_ORD_Q)));
+				}
+				float s = hsum(acc);
+				for (; i < n; ++i) {
+					if (!std::isnan(a[i])) s += a[i];
+				}
+				return s;
+			}
+
+			void avx2AbsDiff(const float *a, const float *b, float *out, size_t n) {
+				const __m256 sign = _mm256_set1_ps(-0.f);
+				size_t i = 0;
+				for (; i + 8 <= n; i += 8) {
+					__m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+					_mm256_storeu_ps(out + i, _mm256_andnot_ps(sign, d));
+				}
+				for (; i < n; ++i) {
+					out[i] = std::abs(a[i] - b[i]);
+				}
+			}
+
+			size_t avx2NanCount(const float *a, size_t n) {
+				size_t c = 0;
+				size_t i = 0;
+				for (; i + 8 <= n; i += 8) {
+					__m256 v = _mm256_loadu_ps(a + i);
+					unsigned m = unsigned(_mm256_movemask_ps(_mm256_cmp_ps(v, v, _CMP_UNORD_Q)));
+					for (; m; m &= m - 1) c++;
+				}
+				for (; i < n; ++i) {
+					c += std::isnan(a[i]);
+				}
+				return c;
+			}
+
+			void avx2DecodeHalf(const uint16_t *a, float *out, size_t n) {
+				size_t i = 0;
+				for (; i + 8 <= n; i += 8) {
+					__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+					_mm256_storeu_ps(out + i, _mm256_cvtph_ps(v));
+				}
+				if (i < n) {
+					alignas(16) uint16_t in[8] = {};
+					alignas(32) float res[8];
+					for (size_t k = 0; k < n - i; ++k) in[k] = a[i + k];
+					_mm256_store_ps(res, _mm256_cvtph_ps(_mm_load_si128(reinterpret_cast<const __m128i *>(in))));
+					for (size_t k = 0; k < n - i; ++k) out[i + k] = res[k];
+				}
+			}
+
+			void avx2DecodeInt16(const int16_t *a, float offset, float scale, float *out, size_t n) {
+				const __m256 vo = _mm256_set1_ps(offset), vs = _mm256_set1_ps(scale);
+				const __m256 code = _mm256_set1_ps(int16NaN), nan = _mm256_set1_ps(NAN);
+				size_t i = 0;
+				for (; i + 8 <= n; i += 8) {
+					__m256 v = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i))));
+					_mm256_storeu_ps(out + i, _mm256_blendv_ps(_mm256_fmadd_ps(vs, v, vo), nan, _mm256_cmp_ps(v, code, _CMP_EQ_OQ)));
+				}
+				for (; i < n; ++i) {
+					out[i] = a[i] == int16NaN ? NAN : offset + scale * a[i];
+				}
+			}
+		}
+#endif
+
+
+		namespace detail {
+
+			const table * avx2Table() {
+#ifdef ZHOU_KERNELS_AVX2
+				static const table t = { "avx2", avx2MaskedSSD, avx2MaskedSum, avx2AbsDiff, avx2NanCount, avx2DecodeHalf, avx2DecodeInt16 };
+				return &t;
+#else
+				return nullptr;
+#endif
+			}
+		}
+	}
+}
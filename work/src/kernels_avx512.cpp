@@ -0,0 +1,144 @@
+
+// std
+#include <cmath>
+#include <cstdint>
+
+// project
+#include "kernels.hpp"
+
+// compiled with AVX-512F enabled (see CMakeLists.txt), only called after the
+// CPU has been checked for support
+#if defined(__AVX512F__)
+#define ZHOU_KERNELS_AVX512
+#include <immintrin.h>
+#endif
+
+
+namespace zhou {
+	namespace kernels {
+
+#ifdef ZHOU_KERNELS_AVX512
+		namespace {
+
+			// (_mm512_reduce_add_ps trips -Wuninitialized in some GCC headers)
+			inline float hsum(__m512 v) {
+				alignas(64) float lanes[16];
+				_mm512_store_ps(lanes, v);
+				float s = 0;
+				for (int i = 0; i < 16; ++i) s += lanes[i];
+				return s;
+			}
+
+			// GCC's conversion intrinsics start from _mm512_undefined_*, which it
+			// then warns about once they are inlined, so the warning is only
+			// silenced for these wrappers
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+			inline __m512 halfToFloat(__m256i v) {
+				return _mm512_cvtph_ps(v);
+			}
+
+			inline __m512 int16ToFloat(__m256i v) {
+				return _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(v));
+			}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+			// lanes of the final partial vector
+			inline __mmask16 tailMask(size_t remaining) {
+				return __mmask16((1u << remaining) - 1);
+			}
+
+			float avx512MaskedSSD(const float *a, const float *b, size_t n) {
+				__m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+				size_t i = 0;
+				for (; i + 32 <= n; i += 32) {
+					__m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+					__m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+					acc0 = _mm512_mask3_fmadd_ps(d0, d0, acc0, _mm512_cmp_ps_mask(d0, d0, _CMP_ORD_Q));
+					acc1 = _mm512_mask3_fmadd_ps(d1, d1, acc1, _mm512_cmp_ps_mask(d1, d1, _CMP_ORD_Q));
+				}
+				for (; i < n; i += 16) {
+					__mmask16 load = n - i >= 16 ? __mmask16(0xffff) : tailMask(n - i);
+					__m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(load, a + i), _mm512_maskz_loadu_ps(load, b + i));
+					acc0 = _mm512_mask3_fmadd_ps(d, d, acc0, _mm512_cmp_ps_mask(d, d, _CMP_ORD_Q));
+				}
+				return hsum(_mm512_add_ps(acc0, acc1));
+			}
+
+			float avx512MaskedSum(const float *a, size_t n) {
+				__m512 acc = _mm512_setzero_ps();
+				for (size_t i = 0; i < n; i += 16) {
+					__mmask16 load = n - i >= 16 ? __mmask16(0xffff) : tailMask(n - i);
+					__m512 v = _mm512_maskz_loadu_ps(load, a + i);
+					acc = _mm512_mask_add_ps(acc, _mm512_cmp_ps_mask(v, v, _CMP_ORD_Q), acc, v);
+				}
+				return hsum(acc);
+			}
+
+			void avx512AbsDiff(const float *a, const float *b, float *out, size_t n) {
+				for (size_t i = 0; i < n; i += 16) {
+					__mmask16 load = n - i >= 16 ? __mmask16(0xffff) : tailMask(n - i);
+					__m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(load, a + i), _mm512_maskz_loadu_ps(load, b + i));
+					_mm512_mask_storeu_ps(out + i, load, _mm512_abs_ps(d));
+				}
+			}
+
+			size_t avx512NanCount(const float *a, size_t n) {
+				size_t c = 0;
+				for (size_t i = 0; i < n; i += 16) {
+					__mmask16 load = n - i >= 16 ? __mmask16(0xffff) : tailMask(n - i);
+					__m512 v = _mm512_maskz_loadu_ps(load, a + i);
+					unsigned m = unsigned(_mm512_cmp_ps_mask(v, v, _CMP_UNORD_Q));
+					for (; m; m &= m - 1) c++;
+				}
+				return c;
+			}
+
+			void avx512DecodeHalf(const uint16_t *a, float *out, size_t n) {
+				size_t i = 0;
+				for (; i + 16 <= n; i += 16) {
+					__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+					_mm512_storeu_ps(out + i, halfToFloat(v));
+				}
+				if (i < n) {
+					alignas(32) uint16_t in[16] = {};
+					for (size_t k = 0; k < n - i; ++k) in[k] = a[i + k];
+					__m256i v = _mm256_load_si256(reinterpret_cast<const __m256i *>(in));
+					_mm512_mask_storeu_ps(out + i, tailMask(n - i), halfToFloat(v));
+				}
+			}
+
+			void avx512DecodeInt16(const int16_t *a, float offset, float scale, float *out, size_t n) {
+				const __m512 vo = _mm512_set1_ps(offset), vs = _mm512_set1_ps(scale);
+				const __m512 code = _mm512_set1_ps(int16NaN), nan = _mm512_set1_ps(NAN);
+				size_t i = 0;
+				for (; i + 16 <= n; i += 16) {
+					__m512 v = int16ToFloat(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)));
+					_mm512_storeu_ps(out + i, _mm512_mask_mov_ps(_mm512_fmadd_ps(vs, v, vo), _mm512_cmp_ps_mask(v, code, _CMP_EQ_OQ), nan));
+				}
+				for (; i < n; ++i) {
+					out[i] = a[i] == int16NaN ? NAN : offset + scale * a[i];
+				}
+			}
+		}
+#endif
+
+
+		namespace detail {
+
+			const table * avx512Table() {
+#ifdef ZHOU_KERNELS_AVX512
+				static const table t = { "avx512", avx512MaskedSSD, avx512MaskedSum, avx512AbsDiff, avx512NanCount, avx512DecodeHalf, avx512DecodeInt16 };
+				return &t;
+#else
+				return nullptr;
+#endif
+			}
+		}
+	}
+}
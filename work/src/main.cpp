@@ -15,6 +15,7 @@
 #include "graphcut.hpp"
 #include "patchmerge.hpp"
 #include "zhou.hpp"
+#include "profile.hpp"
 
 
 using namespace cv;
@@ -195,6 +196,8 @@ void testSeamRemoval() {
 
 
 void testSynthesis() {
+
+	zhou::profile::enable();
 	
 	//zhou::terrain test_terrain = zhou::terrainReadImage("work/res/mount_jackson.png", 0, 255, 1);
 	//zhou::terrain test_terrain = zhou::terrainReadTIFF("work/res/mt_fuji_n035e138.tif");
@@ -209,7 +212,79 @@ void testSynthesis() {
 	Mat synthesis = zhou::synthesize(test_terrain.heightmap, sketchmap, p);
 
 	imwrite("output/salps_synth.png", zhou::heightmapToImage(synthesis));
-	zhou::terrainWriteTxt("output/salps_synth.asc", zhou::terrain(synthesis, test_terrain.spacing));
+	zhou::terrain result(synthesis, test_terrain.spacing);
+	result.geo = test_terrain.geo;
+	zhou::terrainWriteTxt("output/salps_synth.asc", result);
+	zhou::terrainWriteTIFF("output/salps_synth.tif", result);
+
+	zhou::profile::writeChromeTrace("output/trace.json");
+	zhou::profile::printSummary(cout);
+}
+
+
+void testLibrarySynthesis() {
+
+	zhou::profile::enable();
+
+	zhou::examplelibrary library;
+	zhou::terrain fuji = zhou::terrainReadTIFF("work/res/mt_fuji_n035e138.tif");
+	zhou::terrain jackson = zhou::terrainReadTIFF("work/res/mount_jackson_n39_w107_3arc.tif");
+	zhou::terrain salps = zhou::terrainReadTIFF("work/res/southern_alps_s045e169.tif");
+	library.add(fuji.heightmap, "mt_fuji");
+	library.add(jackson.heightmap, "mount_jackson");
+	library.add(salps.heightmap, "southern_alps");
+
+	Mat sketchmap, image2 = imread("work/res/fractal_terrain.png", CV_LOAD_IMAGE_GRAYSCALE);
+	image2.convertTo(sketchmap, CV_32FC1);
+
+	zhou::synthesisparams p;
+	p.ppaGridSpacing = 30;
+	library.analyze(p);
+	Mat synthesis = zhou::synthesize(library, sketchmap, p);
+
+	imwrite("output/library_synth.png", zhou::heightmapToImage(synthesis));
+	zhou::terrain result(synthesis, salps.spacing);
+	zhou::terrainWriteTIFF("output/library_synth.tif", result);
+
+	zhou::profile::printSummary(cout);
+}
+
+
+void testCheckpoint() {
+
+	zhou::terrain test_terrain = zhou::terrainReadTIFF("work/res/southern_alps_s045e169.tif");
+
+	Mat sketchmap, image2 = imread("work/res/fractal_terrain.png", CV_LOAD_IMAGE_GRAYSCALE);
+	image2.convertTo(sketchmap, CV_32FC1);
+
+	zhou::synthesisparams p;
+	p.ppaGridSpacing = 30;
+	Mat expected = zhou::synthesize(test_terrain.heightmap, sketchmap, p);
+
+	// interrupt the run every few batches (in both phases) and resume it from
+	// its checkpoint until it is done
+	p.checkpointPath = "output/checkpoint_test.ckpt";
+	p.checkpointInterval = 1e9;
+	int batches = 0, runs = 1;
+	p.interrupt = [&] { return ++batches % 7 == 0; };
+	Mat synthesis = zhou::synthesize(test_terrain.heightmap, sketchmap, p);
+	while (zhou::readCheckpoint(p.checkpointPath).phase != zhou::checkpoint::PHASE_DONE) {
+		synthesis = zhou::synthesizeResume(test_terrain.heightmap, sketchmap, p);
+		runs++;
+	}
+
+	// the same heights, and NaN in the same places
+	Mat a = expected.clone(), b = synthesis.clone();
+	Mat nanA = a != a, nanB = b != b;
+	int nanMismatch = countNonZero(nanA != nanB);
+	patchNaNs(a, 0);
+	patchNaNs(b, 0);
+	double difference = norm(a, b, NORM_INF);
+	cout << "checkpoint: " << runs << " runs over " << batches << " batches, max difference " << difference << ", NaN mismatches " << nanMismatch << endl;
+	if (difference != 0 || nanMismatch != 0) {
+		cerr << "Resumed synthesis differs from the uninterrupted one" << endl;
+	}
+	remove(p.checkpointPath.c_str());
 }
 
 
@@ -246,6 +321,8 @@ int main( int argc, char** argv ) {
 	//testRotation();
 	//testGraphCut();
 	//testSeamRemoval();
+	//testLibrarySynthesis();
+	//testCheckpoint();
 	testSynthesis();
 
 	// wait for a keystroke in the window before exiting
@@ -0,0 +1,244 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+
+namespace zhou {
+
+	// Solves the screened Poisson problem on a masked grid
+	//
+	//   sum_q w_pq (x_p - x_q) + s_p x_p = b_p
+	//
+	// where q are the 4-neighbours of p, w_pq are edge weights (0 where there is
+	// no edge, eg. across the mask boundary) and s_p is a screening (Dirichlet)
+	// weight. Grid cells with no edges and no screening are not unknowns and are
+	// left untouched.
+	//
+	// Uses conjugate gradients preconditioned by a geometric multigrid V-cycle.
+	// Coarse levels aggregate 2x2 blocks of cells, summing the edge weights that
+	// cross between blocks (a Galerkin coarse operator for piecewise-constant
+	// interpolation), so the masked geometry is kept on every level. Smoothing is
+	// red-black Gauss-Seidel, forward before and backward after the coarse
+	// correction, which keeps the preconditioner symmetric.
+	class multigridsolver {
+	private:
+		struct level {
+			int rows = 0, cols = 0;
+			std::vector<float> east;   // weight of the edge from (i, j) to (i, j+1)
+			std::vector<float> south;  // weight of the edge from (i, j) to (i+1, j)
+			std::vector<float> diag;   // sum of edge weights plus screening
+			std::vector<float> x, b, ax;
+		};
+
+		std::vector<level> m_levels;
+
+		// number of red-black sweeps before and after the coarse correction
+		static const int smoothingSweeps = 2;
+		static const int coarsestSweeps = 16;
+		static const int coarsestCells = 64;
+
+		static void computeDiagonal(level &l, const std::vector<float> &screen) {
+			l.diag = screen;
+			for (int i = 0; i < l.rows; ++i) {
+				for (int j = 0; j < l.cols; ++j) {
+					int p = i * l.cols + j;
+					if (j + 1 < l.cols) { l.diag[p] += l.east[p]; l.diag[p + 1] += l.east[p]; }
+					if (i + 1 < l.rows) { l.diag[p] += l.south[p]; l.diag[p + l.cols] += l.south[p]; }
+				}
+			}
+		}
+
+		// sum of w_pq x_q
+		static float neighbourSum(const level &l, const float *x, int i, int j) {
+			int p = i * l.cols + j;
+			float s = 0;
+			if (j > 0) s += l.east[p - 1] * x[p - 1];
+			if (j + 1 < l.cols) s += l.east[p] * x[p + 1];
+			if (i > 0) s += l.south[p - l.cols] * x[p - l.cols];
+			if (i + 1 < l.rows) s += l.south[p] * x[p + l.cols];
+			return s;
+		}
+
+		// y = Ax
+		static void apply(const level &l, const float *x, float *y) {
+			for (int i = 0; i < l.rows; ++i) {
+				for (int j = 0; j < l.cols; ++j) {
+					int p = i * l.cols + j;
+					y[p] = l.diag[p] > 0 ? l.diag[p] * x[p] - neighbourSum(l, x, i, j) : 0;
+				}
+			}
+		}
+
+		// one Gauss-Seidel pass over the cells of a single colour
+		static void sweep(level &l, int colour) {
+			for (int i = 0; i < l.rows; ++i) {
+				for (int j = (i + colour) % 2; j < l.cols; j += 2) {
+					int p = i * l.cols + j;
+					if (l.diag[p] > 0) {
+						l.x[p] = (l.b[p] + neighbourSum(l, l.x.data(), i, j)) / l.diag[p];
+					}
+				}
+			}
+		}
+
+		// approximately solves A x = b on level k (x starts at zero)
+		void vcycle(size_t k) {
+			level &l = m_levels[k];
+			std::fill(l.x.begin(), l.x.end(), 0.f);
+
+			if (k + 1 == m_levels.size()) {
+				for (int s = 0; s < coarsestSweeps; ++s) {
+					sweep(l, 0); sweep(l, 1);
+					sweep(l, 1); sweep(l, 0);
+				}
+				return;
+			}
+
+			for (int s = 0; s < smoothingSweeps; ++s) {
+				sweep(l, 0); sweep(l, 1);
+			}
+
+			// restrict the residual
+			level &c = m_levels[k + 1];
+			apply(l, l.x.data(), l.ax.data());
+			std::fill(c.b.begin(), c.b.end(), 0.f);
+			for (int i = 0; i < l.rows; ++i) {
+				for (int j = 0; j < l.cols; ++j) {
+					int p = i * l.cols + j;
+					c.b[(i / 2) * c.cols + j / 2] += l.b[p] - l.ax[p];
+				}
+			}
+
+			vcycle(k + 1);
+
+			// prolong the correction
+			for (int i = 0; i < l.rows; ++i) {
+				for (int j = 0; j < l.cols; ++j) {
+					int p = i * l.cols + j;
+					if (l.diag[p] > 0) l.x[p] += c.x[(i / 2) * c.cols + j / 2];
+				}
+			}
+
+			for (int s = 0; s < smoothingSweeps; ++s) {
+				sweep(l, 1); sweep(l, 0);
+			}
+		}
+
+		static double dot(const std::vector<float> &a, const std::vector<float> &b) {
+			double s = 0;
+			for (size_t i = 0; i < a.size(); ++i) s += double(a[i]) * b[i];
+			return s;
+		}
+
+	public:
+		// east and south are rows * cols edge weights, screen is rows * cols
+		multigridsolver(int rows, int cols, std::vector<float> east, std::vector<float> south, const std::vector<float> &screen) {
+			assert(east.size() == size_t(rows) * cols);
+			assert(south.size() == size_t(rows) * cols);
+			assert(screen.size() == size_t(rows) * cols);
+
+			level fine;
+			fine.rows = rows;
+			fine.cols = cols;
+			fine.east = std::move(east);
+			fine.south = std::move(south);
+			computeDiagonal(fine, screen);
+			m_levels.push_back(std::move(fine));
+
+			std::vector<float> fineScreen = screen;
+			while (m_levels.back().rows * m_levels.back().cols > coarsestCells && m_levels.back().rows > 1 && m_levels.back().cols > 1) {
+				const level &f = m_levels.back();
+				level c;
+				c.rows = (f.rows + 1) / 2;
+				c.cols = (f.cols + 1) / 2;
+				c.east.assign(size_t(c.rows) * c.cols, 0.f);
+				c.south.assign(size_t(c.rows) * c.cols, 0.f);
+				std::vector<float> coarseScreen(size_t(c.rows) * c.cols, 0.f);
+				for (int i = 0; i < f.rows; ++i) {
+					for (int j = 0; j < f.cols; ++j) {
+						int p = i * f.cols + j;
+						int q = (i / 2) * c.cols + j / 2;
+						coarseScreen[q] += fineScreen[p];
+						// edges inside a block vanish, edges between blocks are summed
+						if (j % 2 == 1 && j + 1 < f.cols) c.east[q] += f.east[p];
+						if (i % 2 == 1 && i + 1 < f.rows) c.south[q] += f.south[p];
+					}
+				}
+				computeDiagonal(c, coarseScreen);
+				fineScreen = std::move(coarseScreen);
+				m_levels.push_back(std::move(c));
+			}
+
+			for (level &l : m_levels) {
+				l.x.assign(size_t(l.rows) * l.cols, 0.f);
+				l.b.assign(size_t(l.rows) * l.cols, 0.f);
+				l.ax.assign(size_t(l.rows) * l.cols, 0.f);
+			}
+		}
+
+		int levels() const { return int(m_levels.size()); }
+
+		// solves from the initial guess in x (warm start)
+		// stops when |b - Ax| <= tolerance * |b|, returns the number of iterations
+		int solve(std::vector<float> &x, const std::vector<float> &b, float tolerance = 1e-5f, int maxIterations = 200, float *error = nullptr) {
+			level &f = m_levels[0];
+			const size_t n = size_t(f.rows) * f.cols;
+			assert(x.size() == n && b.size() == n);
+
+			std::vector<float> r(n), z(n), p(n), ap(n);
+
+			// unknowns only
+			for (size_t i = 0; i < n; ++i) {
+				if (!(f.diag[i] > 0)) x[i] = 0;
+			}
+
+			apply(f, x.data(), ap.data());
+			for (size_t i = 0; i < n; ++i) {
+				r[i] = f.diag[i] > 0 ? b[i] - ap[i] : 0;
+			}
+
+			const double bnorm = std::max(std::sqrt(dot(b, b)), 1e-30);
+			double rnorm = std::sqrt(dot(r, r));
+			int it = 0;
+			if (rnorm > tolerance * bnorm) {
+				auto precondition = [&]() {
+					f.b = r;
+					vcycle(0);
+					z = f.x;
+				};
+
+				precondition();
+				p = z;
+				double rz = dot(r, z);
+				for (it = 1; it <= maxIterations; ++it) {
+					apply(f, p.data(), ap.data());
+					double pap = dot(p, ap);
+					if (!(pap > 0)) break;
+					double alpha = rz / pap;
+					for (size_t i = 0; i < n; ++i) {
+						x[i] += float(alpha * p[i]);
+						r[i] -= float(alpha * ap[i]);
+					}
+					rnorm = std::sqrt(dot(r, r));
+					if (rnorm <= tolerance * bnorm) break;
+
+					precondition();
+					double rzNext = dot(r, z);
+					double beta = rzNext / rz;
+					rz = rzNext;
+					for (size_t i = 0; i < n; ++i) {
+						p[i] = float(z[i] + beta * p[i]);
+					}
+				}
+				it = std::min(it, maxIterations);
+			}
+
+			if (error) *error = float(rnorm / bnorm);
+			return it;
+		}
+	};
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+// std
+#include <atomic>
+#include <exception>
+#include <mutex>
+
+// opencv
+#include <opencv2/core.hpp>
+
+
+namespace zhou {
+
+	namespace detail {
+
+		template <typename F>
+		class parallelbody : public cv::ParallelLoopBody {
+		private:
+			const F &m_f;
+			mutable std::mutex m_mutex;
+			mutable std::exception_ptr m_error;
+
+		public:
+			explicit parallelbody(const F &f) : m_f(f) { }
+
+			void operator()(const cv::Range &range) const override {
+				try {
+					for (int i = range.start; i < range.end; ++i) {
+						m_f(i);
+					}
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> lock(m_mutex);
+					if (!m_error) m_error = std::current_exception();
+				}
+			}
+
+			void rethrow() const {
+				if (m_error) std::rethrow_exception(m_error);
+			}
+		};
+	}
+
+
+	// calls f(i) for every i in [begin, end) on OpenCV's thread pool
+	// the first exception thrown by any iteration is rethrown on the calling thread
+	template <typename F>
+	inline void parallelFor(int begin, int end, const F &f) {
+		if (end <= begin) return;
+		detail::parallelbody<F> body(f);
+		cv::parallel_for_(cv::Range(begin, end), body);
+		body.rethrow();
+	}
+
+
+	// lowers value to v if v is smaller, from any thread
+	inline void atomicMin(std::atomic<float> &value, float v) {
+		float current = value.load();
+		while (v < current && !value.compare_exchange_weak(current, v)) { }
+	}
+}
@@ -0,0 +1,301 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// opencv
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+// project
+#include "arena.hpp"
+#include "kernels.hpp"
+
+
+namespace zhou {
+
+	// storage precision of the patch bank
+	enum {
+		HEIGHT_FLOAT32,
+		HEIGHT_FLOAT16, // IEEE half precision
+		HEIGHT_INT16    // offset + scale * q, with the offset and scale fitted to the bank (NaN kept as kernels::int16NaN)
+	};
+
+
+	// Candidate patches copied into one contiguous, 64-byte aligned buffer
+	//
+	// Each patch is stored row-major with no gaps between rows and padded to a
+	// multiple of 64 bytes, so comparing a target against every candidate streams
+	// through memory linearly. Per-patch sums and squared norms are precomputed,
+	// and optional reduced-resolution levels (each a 2x2 box average of the one
+	// above) give cheap lower bounds on the full resolution SSD.
+	//
+	// The full resolution patches can be stored at reduced precision to halve the
+	// memory streamed per comparison, they are decoded to float in small blocks
+	// as they are compared. Everything is computed from the decoded values (the
+	// reduced levels are built from them and kept as float) so the bounds hold
+	// for exactly the patches that are returned.
+	class patchbank {
+	public:
+		static const int alignment = 64; // bytes
+
+		struct level {
+			int size = 0;                  // patch width/height at this level
+			size_t stride = 0;             // elements between consecutive patches
+			size_t elemSize = 0;           // bytes per element
+			unsigned char *data = nullptr; // first patch (aligned)
+			std::vector<float> sums;       // per-patch sum of values
+			std::vector<float> norms;      // per-patch sum of squared values
+		};
+
+		// a target prepared for comparison against the bank
+		// unknown values (and the padding) are NaN so the kernels skip them
+		struct query {
+			std::vector<std::vector<float>> values;  // per level, padded like the bank
+			std::vector<int> known;                  // per level, number of known values
+			float norm = 0;                          // sum of squared known values (full resolution)
+		};
+
+	private:
+		std::vector<unsigned char> m_storage;
+		std::vector<level> m_levels;
+		int m_count = 0;
+		int m_precision = HEIGHT_FLOAT32;
+		float m_offset = 0, m_scale = 1; // HEIGHT_INT16 only
+
+		static size_t paddedElements(int size, size_t elemSize) {
+			const size_t n = alignment / elemSize;
+			return (size_t(size) * size + n - 1) / n * n;
+		}
+
+		// copy a patch into the bank layout (rows back to back)
+		static void pack(const cv::Mat patch, float *out) {
+			for (int i = 0; i < patch.rows; ++i) {
+				const float *row = patch.ptr<float>(i);
+				std::copy(row, row + patch.cols, out + i * patch.cols);
+			}
+		}
+
+		void encode(const float *in, unsigned char *out, size_t n) const {
+			if (m_precision == HEIGHT_FLOAT16) {
+				kernels::encodeHalf(in, reinterpret_cast<uint16_t *>(out), n);
+			}
+			else if (m_precision == HEIGHT_INT16) {
+				int16_t *q = reinterpret_cast<int16_t *>(out);
+				for (size_t k = 0; k < n; ++k) {
+					if (std::isnan(in[k])) {
+						q[k] = kernels::int16NaN;
+						continue;
+					}
+					q[k] = int16_t(std::min(std::max(cvRound((in[k] - m_offset) / m_scale), -32767), 32767));
+				}
+			}
+			else {
+				std::copy(in, in + n, reinterpret_cast<float *>(out));
+			}
+		}
+
+		// n elements starting at element first of patch p (full resolution)
+		void decode(int p, size_t first, size_t n, float *out) const {
+			const level &l = m_levels[0];
+			const unsigned char *in = l.data + (l.stride * p + first) * l.elemSize;
+			if (m_precision == HEIGHT_FLOAT16) {
+				kernels::decodeHalf(reinterpret_cast<const uint16_t *>(in), out, n);
+			}
+			else if (m_precision == HEIGHT_INT16) {
+				kernels::decodeInt16(reinterpret_cast<const int16_t *>(in), m_offset, m_scale, out, n);
+			}
+			else {
+				const float *f = reinterpret_cast<const float *>(in);
+				std::copy(f, f + n, out);
+			}
+		}
+
+	public:
+		patchbank() { }
+
+		// levels is the number of resolutions stored, 1 for full resolution only
+		// levels are dropped if the patch size is not divisible down to them
+		patchbank(const std::vector<cv::Mat> &patches, int levels = 1, int precision = HEIGHT_FLOAT32)
+			: m_count(int(patches.size())), m_precision(precision)
+		{
+			using namespace cv;
+			using namespace std;
+
+			assert(!patches.empty());
+			const int size = patches[0].rows;
+			levels = max(1, levels);
+			while (levels > 1 && (size % (1 << (levels - 1)) != 0)) levels--;
+
+			// fit the integer range to the (non-NaN) values of the bank
+			if (m_precision == HEIGHT_INT16) {
+				float lo = numeric_limits<float>::infinity(), hi = -lo;
+				for (const Mat &patch : patches) {
+					for (int i = 0; i < patch.rows; ++i) {
+						const float *row = patch.ptr<float>(i);
+						for (int j = 0; j < patch.cols; ++j) {
+							if (row[j] < lo) lo = row[j];
+							if (row[j] > hi) hi = row[j];
+						}
+					}
+				}
+				m_offset = lo <= hi ? (lo + hi) / 2 : 0.f;
+				m_scale = hi > lo ? float((double(hi) - lo) / 65534) : 1.f;
+			}
+
+			// lay out every level in one allocation
+			size_t total = 0;
+			m_levels.resize(levels);
+			for (int l = 0; l < levels; ++l) {
+				level &lv = m_levels[l];
+				lv.size = size >> l;
+				lv.elemSize = (l == 0 && m_precision != HEIGHT_FLOAT32) ? 2 : sizeof(float);
+				lv.stride = paddedElements(lv.size, lv.elemSize);
+				total += lv.stride * lv.elemSize * m_count;
+			}
+			m_storage.assign(total + alignment, 0);
+			unsigned char *base = m_storage.data();
+			base += (alignment - reinterpret_cast<uintptr_t>(base) % alignment) % alignment;
+			for (int l = 0; l < levels; ++l) {
+				m_levels[l].data = base;
+				m_levels[l].sums.resize(m_count);
+				m_levels[l].norms.resize(m_count);
+				base += m_levels[l].stride * m_levels[l].elemSize * m_count;
+			}
+
+			const vector<float> zeros(m_levels[0].stride, 0.f);
+			vector<float> packed(m_levels[0].stride, 0.f);
+			for (int p = 0; p < m_count; ++p) {
+				assert(patches[p].type() == CV_32FC1);
+				assert(patches[p].rows == size && patches[p].cols == size);
+
+				// store the full resolution, then continue from what was stored
+				pack(patches[p], packed.data());
+				encode(packed.data(), m_levels[0].data + m_levels[0].stride * m_levels[0].elemSize * p, size_t(size) * size);
+				Mat current = patch(p).clone();
+
+				for (int l = 0; l < levels; ++l) {
+					if (l > 0) {
+						resize(current, current, Size(m_levels[l].size, m_levels[l].size), 0, 0, INTER_AREA);
+						pack(current, reinterpret_cast<float *>(m_levels[l].data) + m_levels[l].stride * p);
+					}
+					pack(current, packed.data());
+					const size_t n = size_t(m_levels[l].size) * m_levels[l].size;
+					m_levels[l].sums[p] = kernels::maskedSum(packed.data(), n);
+					m_levels[l].norms[p] = kernels::maskedSSD(packed.data(), zeros.data(), n);
+				}
+			}
+		}
+
+		int count() const { return m_count; }
+		int levels() const { return int(m_levels.size()); }
+		int patchSize(int l = 0) const { return m_levels[l].size; }
+		int precision() const { return m_precision; }
+		bool empty() const { return m_count == 0; }
+
+		// bytes held for the patches (all levels)
+		size_t bytes() const { return m_storage.size(); }
+
+		const level & getLevel(int l) const { return m_levels[l]; }
+		float sum(int p, int l = 0) const { return m_levels[l].sums[p]; }
+		float norm(int p, int l = 0) const { return m_levels[l].norms[p]; }
+
+		// float patch, a header into the bank when stored as float, otherwise decoded
+		// (into scratch memory inside a scratchscope)
+		cv::Mat patch(int p, int l = 0) const {
+			int s = m_levels[l].size;
+			if (l > 0 || m_precision == HEIGHT_FLOAT32) {
+				const float *data = reinterpret_cast<const float *>(m_levels[l].data) + m_levels[l].stride * p;
+				return cv::Mat(s, s, CV_32FC1, const_cast<float *>(data));
+			}
+			cv::Mat out = scratchMat(s, s, CV_32FC1);
+			decode(p, 0, size_t(s) * s, out.ptr<float>());
+			return out;
+		}
+
+		// prepares a target patch (NaN where unknown) for comparison
+		// a reduced level only keeps the blocks that are entirely known
+		query prepare(const cv::Mat target) const {
+			using namespace cv;
+			using namespace std;
+
+			assert(target.type() == CV_32FC1);
+			assert(target.rows == patchSize() && target.cols == patchSize());
+
+			query q;
+			q.values.resize(levels());
+			q.known.assign(levels(), 0);
+
+			Mat values(target.size(), CV_32FC1), weights(target.size(), CV_32FC1);
+			for (int i = 0; i < target.rows; ++i) {
+				const float *t = target.ptr<float>(i);
+				float *v = values.ptr<float>(i);
+				float *w = weights.ptr<float>(i);
+				for (int j = 0; j < target.cols; ++j) {
+					bool known = !isnan(t[j]);
+					v[j] = known ? t[j] : 0.f;
+					w[j] = known ? 1.f : 0.f;
+					q.norm += v[j] * v[j];
+				}
+			}
+
+			for (int l = 0; l < levels(); ++l) {
+				int s = patchSize(l);
+				if (l > 0) {
+					resize(values, values, Size(s, s), 0, 0, INTER_AREA);
+					resize(weights, weights, Size(s, s), 0, 0, INTER_AREA);
+				}
+				q.values[l].assign(m_levels[l].stride, numeric_limits<float>::quiet_NaN());
+				float *v = q.values[l].data();
+				pack(values, v);
+				for (int i = 0; i < s; ++i) {
+					const float *w = weights.ptr<float>(i);
+					for (int j = 0; j < s; ++j) {
+						// partially known blocks can't bound the SSD
+						if (w[j] < 0.999f) v[i * s + j] = numeric_limits<float>::quiet_NaN();
+						else q.known[l]++;
+					}
+				}
+			}
+			return q;
+		}
+
+		// sum of squared differences over the known values of the target
+		// for l > 0 this is a lower bound of the full resolution SSD, as
+		// for any block of n values, sum(d^2) >= n * mean(d)^2
+		float ssd(const query &q, int p, int l = 0) const {
+			const level &lv = m_levels[l];
+			const float *t = q.values[l].data();
+			if (l > 0 || m_precision == HEIGHT_FLOAT32) {
+				const float *c = reinterpret_cast<const float *>(lv.data) + lv.stride * p;
+				float block = float(1 << l);
+				return kernels::maskedSSD(c, t, lv.stride) * block * block;
+			}
+
+			// decode in blocks small enough to stay in L1
+			const size_t chunk = 1024;
+			alignas(64) float decoded[chunk];
+			const size_t n = size_t(lv.size) * lv.size;
+			float s = 0;
+			for (size_t first = 0; first < n; first += chunk) {
+				size_t count = std::min(chunk, n - first);
+				decode(p, first, count, decoded);
+				s += kernels::maskedSSD(decoded, t + first, count);
+			}
+			return s;
+		}
+
+		// lower bound of the full resolution SSD from the precomputed norms
+		// (only available when every value of the target is known)
+		float normBound(const query &q, int p) const {
+			if (q.known[0] != patchSize() * patchSize()) return 0;
+			float d = std::sqrt(norm(p)) - std::sqrt(q.norm);
+			return d * d;
+		}
+	};
+}
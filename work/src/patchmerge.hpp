@@ -1,26 +1,464 @@
 #pragma once
 
 
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <unordered_map>
 #include <unordered_set>
 
 #include <Eigen/Sparse>
 #include <Eigen/IterativeLinearSolvers>
+#include <Eigen/SparseCholesky>
 
 // opencv
 #include <opencv2/core.hpp>
 
 // project
 #include "eigen.hpp"
+#include "profile.hpp"
+#include "multigrid.hpp"
+#include "provenance.hpp"
 
 
 namespace zhou {
 
+	// seam removal solvers
+	enum {
+		POISSON_LEAST_SQUARES, // least squares conjugate gradient on the gradient system
+		POISSON_MULTIGRID,     // multigrid preconditioned conjugate gradient on the normal equations
+		POISSON_CHOLESKY,      // cached sparse LDLT factorization of the normal equations
+		POISSON_DST            // discrete sine transform on fully covered patches (placePatch only), multigrid otherwise
+	};
+
+
+	// The normal equations of the least squares system below, a screened Poisson
+	// equation over the masked pixels:
+	//  - an edge joins every pair of valid neighbours where at least one is masked,
+	//    with target gradient of the current heights (or zero across the seam)
+	//  - valid unmasked pixels next to the mask are held to their current height
+	//    with unit weight (Dirichlet boundary)
+	// Only the bounding box of the mask is assembled. Every weight is one, so the
+	// matrix depends only on the footprint (east, south and screen layout) and the
+	// heights only appear in b.
+	struct seamsystem {
+		cv::Rect box;
+		int rows = 0, cols = 0;
+		std::vector<float> east, south, screen; // per cell of the box
+		std::vector<float> b;                   // right hand side
+		std::vector<float> x;                   // current heights (0 where NaN)
+
+		bool empty() const { return box.empty(); }
+
+		// cells with at least one equation (these are written back)
+		bool unknown(int p) const {
+			int j = p % cols;
+			return east[p] > 0 || south[p] > 0 || screen[p] > 0
+				|| (j > 0 && east[p - 1] > 0) || (p >= cols && south[p - cols] > 0);
+		}
+	};
+
+
+	inline seamsystem assembleSeamSystem(cv::Mat synthesis, cv::Mat mask, cv::Mat seam_mask) {
+		using namespace cv;
+		using namespace std;
+
+		seamsystem sys;
+
+		// mask bounding box, grown by one for the boundary
+		Rect bound(Point(0, 0), mask.size());
+		Rect box;
+		for (int i = 0; i < mask.rows; i++) {
+			const uchar *m = mask.ptr<uchar>(i);
+			for (int j = 0; j < mask.cols; j++) {
+				if (m[j]) box = box.empty() ? Rect(j, i, 1, 1) : box | Rect(j, i, 1, 1);
+			}
+		}
+		if (box.empty()) return sys;
+		box = Rect(box.x - 1, box.y - 1, box.width + 2, box.height + 2) & bound;
+
+		const int rows = box.height, cols = box.width;
+		const size_t n = size_t(rows) * cols;
+		sys.box = box;
+		sys.rows = rows;
+		sys.cols = cols;
+		sys.east.assign(n, 0.f);
+		sys.south.assign(n, 0.f);
+		sys.screen.assign(n, 0.f);
+		sys.b.assign(n, 0.f);
+		sys.x.assign(n, 0.f);
+
+		auto value = [&](int i, int j) { return synthesis.at<float>(box.y + i, box.x + j); };
+		auto masked = [&](int i, int j) { return mask.at<uchar>(box.y + i, box.x + j) != 0; };
+		auto seam = [&](int i, int j) { return seam_mask.at<uchar>(box.y + i, box.x + j) != 0; };
+
+		for (int i = 0; i < rows; i++) {
+			for (int j = 0; j < cols; j++) {
+				int p = i * cols + j;
+				float pvalue = value(i, j);
+				if (isnan(pvalue)) continue;
+				sys.x[p] = pvalue;
+
+				// gradient edges to the right and below
+				// (the target gradient from p to q is b_p += g, b_q -= g)
+				if (j + 1 < cols && !isnan(value(i, j + 1)) && (masked(i, j) || masked(i, j + 1))) {
+					float g = (seam(i, j) && seam(i, j + 1)) ? 0 : pvalue - value(i, j + 1);
+					sys.east[p] = 1;
+					sys.b[p] += g;
+					sys.b[p + 1] -= g;
+				}
+				if (i + 1 < rows && !isnan(value(i + 1, j)) && (masked(i, j) || masked(i + 1, j))) {
+					float g = (seam(i, j) && seam(i + 1, j)) ? 0 : pvalue - value(i + 1, j);
+					sys.south[p] = 1;
+					sys.b[p] += g;
+					sys.b[p + cols] -= g;
+				}
+
+				// dirichlet boundary
+				if (!masked(i, j)) {
+					bool boundary = (j > 0 && masked(i, j - 1)) || (j + 1 < cols && masked(i, j + 1))
+						|| (i > 0 && masked(i - 1, j)) || (i + 1 < rows && masked(i + 1, j));
+					if (boundary) {
+						sys.screen[p] = 1;
+						sys.b[p] += pvalue;
+					}
+				}
+			}
+		}
+		return sys;
+	}
+
+
+	// writes the solved heights of every unknown back into the synthesis
+	inline void applySeamSystem(cv::Mat synthesis, const seamsystem &sys, const std::vector<float> &x) {
+		for (int i = 0; i < sys.rows; i++) {
+			for (int j = 0; j < sys.cols; j++) {
+				int p = i * sys.cols + j;
+				if (sys.unknown(p)) {
+					synthesis.at<float>(sys.box.y + i, sys.box.x + j) = x[p];
+				}
+			}
+		}
+	}
+
+
+	// multigrid preconditioned conjugate gradient, warm started from the current heights
+	inline void poissonSeamRemovalMultigrid(cv::Mat synthesis, cv::Mat mask, cv::Mat seam_mask) {
+		using namespace cv;
+		using namespace std;
+
+		profile::scope prof_assemble("poisson.assemble");
+		seamsystem sys = assembleSeamSystem(synthesis, mask, seam_mask);
+		if (sys.empty()) return;
+
+		multigridsolver solver(sys.rows, sys.cols, sys.east, sys.south, sys.screen);
+		if (profile::enabled()) {
+			int unknowns = 0;
+			for (size_t p = 0; p < sys.x.size(); ++p) unknowns += sys.unknown(int(p));
+			profile::counter("poisson.unknowns", unknowns);
+			profile::counter("poisson.levels", solver.levels());
+			// (estimated from the grid size)
+			profile::counter("poisson.workingset", double(sys.x.size()) * sizeof(float) * 5 * 2);
+		}
+		prof_assemble.end();
+
+		profile::scope prof_solve("poisson.solve");
+		vector<float> x = sys.x;
+		float error = 0;
+		const float tolerance = 1e-5f;
+		const int maxIterations = 200;
+		int iterations = solver.solve(x, sys.b, tolerance, maxIterations, &error);
+		prof_solve.end();
+
+		if (profile::enabled()) {
+			profile::counter("poisson.iterations", iterations);
+			profile::counter("poisson.residual", error);
+		}
+		if (!(error <= tolerance)) {
+			cerr << "Multigrid seam removal did not converge after " << iterations << " iterations (relative residual " << error << ")" << endl;
+		}
+
+		applySeamSystem(synthesis, sys, x);
+	}
+
+
+	// Factorizations of the seam system, keyed by footprint
+	// The matrix only depends on the footprint, so a placement with the same
+	// window shape, NaN layout and mask as an earlier one only needs a back
+	// substitution. Entries are evicted least recently used first. Lookups are
+	// locked, solving with a shared factorization is read-only.
+	class seamfactorcache {
+	public:
+		struct factorization {
+			Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> ldlt;
+			std::vector<int> cells; // box cell of each unknown
+			bool ok = false;
+		};
+
+	private:
+		size_t m_capacity;
+		std::mutex m_mutex;
+		std::list<std::string> m_order; // most recently used first
+		std::unordered_map<std::string, std::pair<std::shared_ptr<const factorization>, std::list<std::string>::iterator>> m_entries;
+
+	public:
+		explicit seamfactorcache(size_t capacity = 16) : m_capacity(capacity) { }
+
+		static std::string footprint(const seamsystem &sys) {
+			std::string key(sizeof(int) * 2 + sys.east.size(), '\0');
+			memcpy(&key[0], &sys.rows, sizeof(int));
+			memcpy(&key[sizeof(int)], &sys.cols, sizeof(int));
+			for (size_t p = 0; p < sys.east.size(); ++p) {
+				key[sizeof(int) * 2 + p] = char((sys.east[p] > 0) | ((sys.south[p] > 0) << 1) | ((sys.screen[p] > 0) << 2));
+			}
+			return key;
+		}
+
+		static std::shared_ptr<const factorization> factorize(const seamsystem &sys) {
+			using namespace std;
+
+			auto f = make_shared<factorization>();
+			vector<int> index(sys.east.size(), -1);
+			for (size_t p = 0; p < sys.east.size(); ++p) {
+				if (sys.unknown(int(p))) {
+					index[p] = int(f->cells.size());
+					f->cells.push_back(int(p));
+				}
+			}
+
+			vector<Eigen::Triplet<double>> triplets;
+			triplets.reserve(f->cells.size() * 5);
+			auto edge = [&](int p, int q) {
+				triplets.emplace_back(index[p], index[p], 1.0);
+				triplets.emplace_back(index[q], index[q], 1.0);
+				triplets.emplace_back(index[p], index[q], -1.0);
+				triplets.emplace_back(index[q], index[p], -1.0);
+			};
+			for (int p : f->cells) {
+				if (sys.east[p] > 0) edge(p, p + 1);
+				if (sys.south[p] > 0) edge(p, p + sys.cols);
+				if (sys.screen[p] > 0) triplets.emplace_back(index[p], index[p], 1.0);
+			}
+
+			// every connected region needs a boundary pixel, otherwise the
+			// heights are only defined up to a constant and the matrix is singular
+			vector<char> visited(sys.east.size(), 0);
+			for (int start : f->cells) {
+				if (visited[start]) continue;
+				bool anchored = false;
+				vector<int> stack(1, start);
+				visited[start] = 1;
+				while (!stack.empty()) {
+					int p = stack.back();
+					stack.pop_back();
+					anchored = anchored || sys.screen[p] > 0;
+					int neighbours[4] = {
+						sys.east[p] > 0 ? p + 1 : -1,
+						sys.south[p] > 0 ? p + sys.cols : -1,
+						(p % sys.cols > 0 && sys.east[p - 1] > 0) ? p - 1 : -1,
+						(p >= sys.cols && sys.south[p - sys.cols] > 0) ? p - sys.cols : -1
+					};
+					for (int q : neighbours) {
+						if (q >= 0 && !visited[q]) {
+							visited[q] = 1;
+							stack.push_back(q);
+						}
+					}
+				}
+				if (!anchored) return f;
+			}
+
+			Eigen::SparseMatrix<double> A(f->cells.size(), f->cells.size());
+			A.setFromTriplets(triplets.begin(), triplets.end());
+			f->ldlt.compute(A);
+			f->ok = f->ldlt.info() == Eigen::Success;
+			return f;
+		}
+
+		std::shared_ptr<const factorization> get(const seamsystem &sys) {
+			using namespace std;
+
+			string key = footprint(sys);
+			{
+				lock_guard<mutex> lock(m_mutex);
+				auto it = m_entries.find(key);
+				if (it != m_entries.end()) {
+					m_order.splice(m_order.begin(), m_order, it->second.second);
+					profile::counter("poisson.cache.hit", 1);
+					return it->second.first;
+				}
+			}
+
+			// factorize outside the lock
+			profile::counter("poisson.cache.miss", 1);
+			shared_ptr<const factorization> f = factorize(sys);
+
+			lock_guard<mutex> lock(m_mutex);
+			if (m_entries.find(key) == m_entries.end()) {
+				m_order.push_front(key);
+				m_entries.emplace(key, make_pair(f, m_order.begin()));
+				while (m_entries.size() > m_capacity) {
+					m_entries.erase(m_order.back());
+					m_order.pop_back();
+				}
+			}
+			return f;
+		}
+
+		static seamfactorcache & global() {
+			static seamfactorcache cache;
+			return cache;
+		}
+	};
+
+
+	// sparse Cholesky (LDLT) on the normal equations, reusing the factorization
+	// of earlier placements with the same footprint
+	// falls back to multigrid if the system is singular (a masked region with no boundary)
+	inline void poissonSeamRemovalCholesky(cv::Mat synthesis, cv::Mat mask, cv::Mat seam_mask) {
+		using namespace cv;
+		using namespace std;
+
+		profile::scope prof_assemble("poisson.assemble");
+		seamsystem sys = assembleSeamSystem(synthesis, mask, seam_mask);
+		if (sys.empty()) return;
+		prof_assemble.end();
+
+		profile::scope prof_factor("poisson.factor");
+		shared_ptr<const seamfactorcache::factorization> f = seamfactorcache::global().get(sys);
+		prof_factor.end();
+		if (!f->ok) {
+			poissonSeamRemovalMultigrid(synthesis, mask, seam_mask);
+			return;
+		}
+		profile::counter("poisson.unknowns", f->cells.size());
+
+		profile::scope prof_solve("poisson.solve");
+		Eigen::VectorXd b(f->cells.size());
+		for (size_t k = 0; k < f->cells.size(); ++k) {
+			b[k] = sys.b[f->cells[k]];
+		}
+		Eigen::VectorXd solution = f->ldlt.solve(b);
+		vector<float> x = sys.x;
+		for (size_t k = 0; k < f->cells.size(); ++k) {
+			x[f->cells[k]] = float(solution[k]);
+		}
+		prof_solve.end();
+
+		applySeamSystem(synthesis, sys, x);
+	}
+
+
+	// 2D type-I discrete sine transform of x, via the DFT of its odd extension
+	// (the extension is real and odd in both directions, so its spectrum is real)
+	inline cv::Mat discreteSineTransform(const cv::Mat x) {
+		using namespace cv;
+
+		assert(x.type() == CV_64FC1);
+
+		const int m = x.rows, n = x.cols;
+		const int R = 2 * (m + 1), C = 2 * (n + 1);
+		Mat ext(R, C, CV_64FC1, Scalar(0));
+		for (int i = 0; i < m; ++i) {
+			for (int j = 0; j < n; ++j) {
+				double v = x.at<double>(i, j);
+				ext.at<double>(i + 1, j + 1) = v;
+				ext.at<double>(R - 1 - i, j + 1) = -v;
+				ext.at<double>(i + 1, C - 1 - j) = -v;
+				ext.at<double>(R - 1 - i, C - 1 - j) = v;
+			}
+		}
+
+		Mat spectrum;
+		dft(ext, spectrum, DFT_COMPLEX_OUTPUT);
+
+		Mat out(m, n, CV_64FC1);
+		for (int i = 0; i < m; ++i) {
+			for (int j = 0; j < n; ++j) {
+				out.at<double>(i, j) = -spectrum.at<Vec2d>(i + 1, j + 1)[0] / 4;
+			}
+		}
+		return out;
+	}
+
+
+	// true if every pixel of the area is masked and the one pixel ring around it
+	// is inside the synthesis and valid, ie. the seam problem is a Poisson equation
+	// on a rectangle with Dirichlet boundary
+	inline bool seamAreaIsRectangle(cv::Mat synthesis, cv::Mat mask, cv::Rect area) {
+		using namespace cv;
+		using namespace std;
+
+		Rect ring(area.x - 1, area.y - 1, area.width + 2, area.height + 2);
+		if ((ring & Rect(Point(0, 0), synthesis.size())) != ring) return false;
+		if (countNonZero(mask(area)) != area.area()) return false;
+		for (int i = ring.y; i < ring.y + ring.height; ++i) {
+			for (int j = ring.x; j < ring.x + ring.width; ++j) {
+				bool border = i == ring.y || i == ring.y + ring.height - 1 || j == ring.x || j == ring.x + ring.width - 1;
+				bool corner = (i == ring.y || i == ring.y + ring.height - 1) && (j == ring.x || j == ring.x + ring.width - 1);
+				if (border && !corner && isnan(synthesis.at<float>(i, j))) return false;
+			}
+		}
+		return true;
+	}
+
+
+	// Exact seam removal for a fully masked rectangle (see seamAreaIsRectangle)
+	// Solves the 5-point Poisson equation with the guidance gradients of the
+	// current heights (zero across the seam) and the surrounding ring held at its
+	// current heights, by diagonalizing the Laplacian with the discrete sine
+	// transform. Unlike the least squares system, the ring is a hard boundary
+	// and is not changed.
+	inline void poissonSeamRemovalRectangle(cv::Mat synthesis, cv::Mat seam_mask, cv::Rect area) {
+		using namespace cv;
+		using namespace std;
+
+		profile::scope prof("poisson.dst");
+
+		const int m = area.height, n = area.width;
+		const Point delta[4] = { {1,0}, {0,1}, {-1,0}, {0,-1} };
+
+		// right hand side, divergence of the guidance plus the boundary values
+		Mat f(m, n, CV_64FC1);
+		for (int i = 0; i < m; ++i) {
+			for (int j = 0; j < n; ++j) {
+				Point p(area.x + j, area.y + i);
+				double vp = synthesis.at<float>(p);
+				double sum = 0;
+				for (int d = 0; d < 4; ++d) {
+					Point q = p + delta[d];
+					double vq = synthesis.at<float>(q);
+					if (!(seam_mask.at<uchar>(p) && seam_mask.at<uchar>(q))) sum += vp - vq;
+					if (!area.contains(q)) sum += vq;
+				}
+				f.at<double>(i, j) = sum;
+			}
+		}
+
+		// divide by the eigenvalues of the Laplacian and transform back
+		Mat u = discreteSineTransform(f);
+		for (int k = 0; k < m; ++k) {
+			double lk = 2 - 2 * cos(CV_PI * (k + 1) / (m + 1));
+			for (int l = 0; l < n; ++l) {
+				double ll = 2 - 2 * cos(CV_PI * (l + 1) / (n + 1));
+				u.at<double>(k, l) /= lk + ll;
+			}
+		}
+		u = discreteSineTransform(u);
+		u *= 4.0 / ((m + 1) * (n + 1));
+
+		u.convertTo(synthesis(area), CV_32F);
+	}
+
+
 	// Given the heightmap, mask and mask offset
 	// modify the heightmap to seamlessly fit in with surroundings
 	// TODO reform to only use values inside the mask?
-	void poissonSeamRemoval(cv::Mat synthesis, cv::Mat mask, cv::Mat seam_mask) {
+	void poissonSeamRemoval(cv::Mat synthesis, cv::Mat mask, cv::Mat seam_mask, int method = POISSON_LEAST_SQUARES) {
 		using namespace cv;
 		using namespace std;
 
@@ -30,6 +468,17 @@ namespace zhou {
 		assert(mask.type() == CV_8UC1);
 		assert(seam_mask.type() == CV_8UC1);
 
+		profile::scope prof("poisson");
+		if (method == POISSON_MULTIGRID || method == POISSON_DST) {
+			poissonSeamRemovalMultigrid(synthesis, mask, seam_mask);
+			return;
+		}
+		if (method == POISSON_CHOLESKY) {
+			poissonSeamRemovalCholesky(synthesis, mask, seam_mask);
+			return;
+		}
+
+		profile::scope prof_assemble("poisson.assemble");
 		
 		// directions and bound
 		Point delta[4] = { {1,0}, {0,1}, {-1,0}, {0,-1} };
@@ -127,6 +576,13 @@ namespace zhou {
 
 		//cout << "Building" << endl;
 
+		if (profile::enabled()) {
+			profile::counter("poisson.unknowns", idToPoint.size());
+			profile::counter("poisson.equations", row);
+			profile::counter("poisson.workingset", double(pointToid.total()) * pointToid.elemSize()
+				+ triplet_list.capacity() * sizeof(Eigen::Triplet<float>) + b_list.capacity() * sizeof(float));
+		}
+
 		// Build the sparse matrix (nxn)
 		Eigen::SparseMatrix<float> A(row, idToPoint.size());
 		Eigen::VectorXf x(idToPoint.size());
@@ -137,6 +593,7 @@ namespace zhou {
 		//cout << "Compressing" << endl;
 
 		A.makeCompressed();
+		prof_assemble.end();
 
 
 		// Solve
@@ -151,11 +608,18 @@ namespace zhou {
 		// solver.factorize(A);
 
 		// cout << "Computing" << endl;
+		profile::scope prof_solve("poisson.solve");
 		solver.compute(A);
 
 		//cout << "Solving " << endl;
 		x = solver.solve(b);
 		//cout << "Finished" << endl;
+		prof_solve.end();
+
+		if (profile::enabled()) {
+			profile::counter("poisson.iterations", solver.iterations());
+			profile::counter("poisson.residual", solver.error());
+		}
 
 
 		// apply the results to the synthesis
@@ -173,7 +637,10 @@ namespace zhou {
 	// place patch using the graphcut mask provided
 	// uses seam removal
 	// assumes patch is non null
-	void placePatch(cv::Mat synthesis, cv::Mat patch, cv::Mat mask, cv::Vec2i pos) {
+	// only reads and writes the synthesis inside the patch area grown by one pixel
+	// if provenance is given, the example coordinates of the patch (coords) are
+	// recorded where the patch is used, under the placement id and example index
+	void placePatch(cv::Mat synthesis, cv::Mat patch, cv::Mat mask, cv::Vec2i pos, int method = POISSON_LEAST_SQUARES, provenancemap *provenance = nullptr, cv::Mat coords = cv::Mat(), int id = -1, int example = 0) {
 		using namespace std;
 		using namespace cv;
 
@@ -182,32 +649,43 @@ namespace zhou {
 		assert(patch.type() == CV_32FC1);
 		assert(mask.type() == CV_8UC1);
 
+		profile::scope prof("placePatch");
+
 		Point delta[4] = { {1,0}, {0,1}, {-1,0}, {0,-1} };
 		Rect patchBound(Point(0, 0), patch.size());
 		Rect synthesisBound(Point(0, 0), synthesis.size());
 
-		// create synthesis-sized overlap mask and seam mask
-		Mat synthesis_overlap(synthesis.rows, synthesis.cols, CV_8UC1, Scalar(false));
-		Mat seam_mask(synthesis.rows, synthesis.cols, CV_8UC1, Scalar(false));
+		// everything happens inside the patch area plus a one pixel ring (the
+		// boundary of the seam problem), so placements elsewhere are untouched
+		Rect area = Rect(Point(pos[0], pos[1]), patch.size());
+		Rect region = Rect(area.x - 1, area.y - 1, area.width + 2, area.height + 2) & synthesisBound;
+		if (region.empty()) return;
+		Mat local = synthesis(region);
+
+		// create region-sized overlap mask and seam mask
+		Mat synthesis_overlap(region.height, region.width, CV_8UC1, Scalar(false));
+		Mat seam_mask(region.height, region.width, CV_8UC1, Scalar(false));
 		for (int i = 0; i < mask.rows; i++) {
 			for (int j = 0; j < mask.cols; j++) {
 				Point p(j + pos[0], i + pos[1]);
 				if (synthesisBound.contains(p)) {
+					Point r = p - region.tl();
+
 					// entire overlap area
-					if (!isnan(synthesis.at<float>(p))) {
-						synthesis_overlap.at<bool>(p) = true;
+					if (!isnan(local.at<float>(r))) {
+						synthesis_overlap.at<bool>(r) = true;
 					}
 
 					// mask value placement
 					if (mask.at<bool>(i, j)) {
-						synthesis.at<float>(p) = patch.at<float>(i, j);
+						local.at<float>(r) = patch.at<float>(i, j);
 					}
 
 					// a seam is pixel in the overlap area and on the cut boundry
 					for (int d = 0; d < 4; d++) {
 						Point neighbour = Point(j, i) + delta[d];
 						if (patchBound.contains(neighbour) && mask.at<bool>(i, j) != mask.at<bool>(neighbour)) {
-							seam_mask.at<bool>(p) = true;
+							seam_mask.at<bool>(r) = true;
 						}
 					}
 				}
@@ -215,7 +693,20 @@ namespace zhou {
 		}
 
 		// remove the seam
-		poissonSeamRemoval(synthesis, synthesis_overlap, seam_mask);
+		// with POISSON_DST, a patch placed entirely over synthesized terrain has
+		// a rectangular problem that is solved directly (with the ring as a hard
+		// boundary, where the other methods only screen it)
+		Rect localArea = area - region.tl();
+		if (method == POISSON_DST && seamAreaIsRectangle(local, synthesis_overlap, localArea)) {
+			poissonSeamRemovalRectangle(local, seam_mask, localArea);
+		}
+		else {
+			poissonSeamRemoval(local, synthesis_overlap, seam_mask, method);
+		}
+
+		if (provenance) {
+			provenance->record(pos, coords, mask, id, example);
+		}
 
 
 		//// debug
@@ -11,6 +11,7 @@
 
 // project
 #include "kruskal.hpp"
+#include "profile.hpp"
 
 
 namespace ppa {
@@ -57,7 +58,7 @@ namespace ppa {
 
 		int feature_type;
 
-		FeatureGraph(const cv::Mat input, int grid_spacing = 10, int profile_length = 7, int feature_type_ = RIDGE_FEATURES) : feature_type(feature_type_) {
+		explicit FeatureGraph(const cv::Mat input, int grid_spacing = 10, int profile_length = 7, int feature_type_ = RIDGE_FEATURES) : feature_type(feature_type_) {
 			assert(!input.empty());
 			assert(input.type() == CV_32FC1);
 			assert(grid_spacing >= 1);
@@ -67,6 +68,8 @@ namespace ppa {
 			using namespace cv;
 			using namespace std;
 
+			zhou::profile::scope prof("ppa");
+
 			// reduce down to operational grid
 			Mat grid;
 			resize(input, grid, input.size() / grid_spacing, 0, 0, INTER_NEAREST);
@@ -105,6 +108,7 @@ namespace ppa {
 
 			// select feature points
 			//
+			zhou::profile::scope prof_select("ppa.select");
 			for (int i = 0; i < grid.rows; i++) {
 				for (int j = 0; j < grid.cols; j++) {
 					Point p(j, i);
@@ -133,8 +137,13 @@ namespace ppa {
 			}
 
 
+			prof_select.end();
+			zhou::profile::counter("ppa.candidates", nodeidcounter);
+
+
 			// create graph
 			//
+			zhou::profile::scope prof_graph("ppa.graph");
 			vector<edge> tempedges;
 			for (int i = 0; i < grid.rows - 1; i++) {
 				for (int j = 0; j < grid.cols - 1; j++) {
@@ -158,6 +167,7 @@ namespace ppa {
 
 			// break cycles
 			//
+			zhou::profile::counter("ppa.graphedges", tempedges.size());
 			tempedges = kruskal::minSpanForest(tempedges);
 
 			for (const edge &e : tempedges) // debug
@@ -215,8 +225,12 @@ namespace ppa {
 			}
 
 
+			prof_graph.end();
+
+
 			// convert from edges to node/path
 			//
+			zhou::profile::scope prof_paths("ppa.paths");
 			unordered_set<int> visited;
 			int edgeidcounter = 0;
 			for (const auto &nte : nodetoedge) {
@@ -276,7 +290,13 @@ namespace ppa {
 			}
 
 
+			prof_paths.end();
+			zhou::profile::counter("ppa.nodes", m_nodes.size());
+			zhou::profile::counter("ppa.edges", m_edges.size());
+
+
 			// debug
+			zhou::profile::scope prof_debug("ppa.debug");
 			for (const auto &n : m_nodes) {
 				circle(debug_ppa, Point(n.second.p), 3, Scalar(0, 0, 225));
 			}
@@ -0,0 +1,252 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// Lightweight scoped timers and counters for the synthesis pipeline
+//
+// Disabled by default, in which case a scope or counter costs a single relaxed
+// atomic load. When enabled, every thread records into its own log (no locking
+// on the hot path) and the logs are merged when the trace or summary is written.
+// Names must be string literals (or otherwise outlive the profile) as only the
+// pointer is stored.
+//
+// usage:
+//   zhou::profile::enable();
+//   { zhou::profile::scope s("graphcut"); ... }
+//   zhou::profile::counter("graphcut.nodes", n);
+//   zhou::profile::writeChromeTrace("output/trace.json");
+//   zhou::profile::printSummary(std::cout);
+namespace zhou {
+	namespace profile {
+
+		using clock = std::chrono::steady_clock;
+
+		struct event {
+			const char *name;
+			char phase;   // 'X' complete (duration) event, 'C' counter event
+			int64_t ts;   // nanoseconds since the profile epoch
+			int64_t dur;  // nanoseconds, only for 'X'
+			double value; // only for 'C'
+		};
+
+		struct statistic {
+			char phase = 'X';
+			int64_t count = 0;
+			double total = 0; // nanoseconds for timers, sum of values for counters
+			double min = std::numeric_limits<double>::infinity();
+			double max = -std::numeric_limits<double>::infinity();
+
+			void add(double v) {
+				count++;
+				total += v;
+				min = std::min(min, v);
+				max = std::max(max, v);
+			}
+
+			void merge(const statistic &o) {
+				phase = o.phase;
+				count += o.count;
+				total += o.total;
+				min = std::min(min, o.min);
+				max = std::max(max, o.max);
+			}
+		};
+
+		// per-thread record of events and aggregated statistics
+		struct threadlog {
+			int tid = 0;
+			std::vector<event> events;
+			std::unordered_map<const char *, statistic> stats;
+			int64_t dropped = 0;
+		};
+
+		struct registry {
+			std::atomic<bool> enabled{ false };
+			std::atomic<size_t> traceLimit{ size_t(1) << 20 }; // max trace events kept per thread
+			clock::time_point epoch = clock::now();
+			std::mutex mutex;
+			std::vector<std::unique_ptr<threadlog>> logs; // owned here so logs outlive their threads
+		};
+
+		inline registry & globalRegistry() {
+			static registry r;
+			return r;
+		}
+
+		inline bool enabled() {
+			return globalRegistry().enabled.load(std::memory_order_relaxed);
+		}
+
+		inline void enable(bool e = true) {
+			globalRegistry().enabled.store(e, std::memory_order_relaxed);
+		}
+
+		inline void setTraceLimit(size_t events_per_thread) {
+			globalRegistry().traceLimit.store(events_per_thread, std::memory_order_relaxed);
+		}
+
+		inline int64_t now() {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - globalRegistry().epoch).count();
+		}
+
+		inline threadlog & localLog() {
+			thread_local threadlog *log = nullptr;
+			if (!log) {
+				registry &r = globalRegistry();
+				std::lock_guard<std::mutex> lock(r.mutex);
+				r.logs.emplace_back(new threadlog());
+				log = r.logs.back().get();
+				log->tid = int(r.logs.size()) - 1;
+			}
+			return *log;
+		}
+
+		inline void record(const event &e, double statvalue) {
+			threadlog &log = localLog();
+			statistic &s = log.stats[e.name];
+			s.phase = e.phase;
+			s.add(statvalue);
+			if (log.events.size() < globalRegistry().traceLimit.load(std::memory_order_relaxed)) {
+				log.events.push_back(e);
+			}
+			else {
+				log.dropped++;
+			}
+		}
+
+		// record a counter value (eg. number of graph nodes)
+		inline void counter(const char *name, double value) {
+			if (!enabled()) return;
+			record(event{ name, 'C', now(), 0, value }, value);
+		}
+
+		// times the enclosing block
+		class scope {
+		private:
+			const char *m_name;
+			int64_t m_start;
+
+		public:
+			explicit scope(const char *name) : m_name(enabled() ? name : nullptr), m_start(m_name ? now() : 0) { }
+
+			scope(const scope &) = delete;
+			scope & operator=(const scope &) = delete;
+
+			~scope() { end(); }
+
+			// finish timing before the end of the enclosing block
+			void end() {
+				if (!m_name) return;
+				int64_t dur = now() - m_start;
+				record(event{ m_name, 'X', m_start, dur, 0 }, double(dur));
+				m_name = nullptr;
+			}
+		};
+
+		// clear all recorded events and statistics
+		// must not be called while other threads are recording
+		inline void reset() {
+			registry &r = globalRegistry();
+			std::lock_guard<std::mutex> lock(r.mutex);
+			for (auto &log : r.logs) {
+				log->events.clear();
+				log->stats.clear();
+				log->dropped = 0;
+			}
+		}
+
+		// Chrome trace-event format (load in chrome://tracing or ui.perfetto.dev)
+		// must not be called while other threads are recording
+		inline void writeChromeTrace(const std::string &filename) {
+			registry &r = globalRegistry();
+			std::lock_guard<std::mutex> lock(r.mutex);
+
+			std::ofstream out(filename);
+			if (!out) {
+				std::cerr << "Could not open trace file : " << filename << std::endl;
+				return;
+			}
+
+			out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+			out << std::fixed << std::setprecision(3);
+			bool first = true;
+			for (const auto &log : r.logs) {
+				for (const event &e : log->events) {
+					if (!first) out << ",\n";
+					first = false;
+					out << "{\"name\":\"" << e.name << "\",\"cat\":\"zhou\",\"ph\":\"" << e.phase
+						<< "\",\"pid\":0,\"tid\":" << log->tid << ",\"ts\":" << (e.ts / 1000.0);
+					if (e.phase == 'X') {
+						out << ",\"dur\":" << (e.dur / 1000.0) << "}";
+					}
+					else {
+						out << ",\"args\":{\"value\":" << e.value << "}}";
+					}
+				}
+			}
+			out << "\n]}\n";
+		}
+
+		// end-of-run summary of every timer and counter, aggregated over threads
+		inline void printSummary(std::ostream &out) {
+			registry &r = globalRegistry();
+			std::lock_guard<std::mutex> lock(r.mutex);
+
+			std::map<std::string, statistic> merged;
+			int64_t dropped = 0;
+			for (const auto &log : r.logs) {
+				for (const auto &item : log->stats) {
+					merged[item.first].merge(item.second);
+				}
+				dropped += log->dropped;
+			}
+
+			std::ios state(nullptr);
+			state.copyfmt(out);
+
+			out << "---- profile summary ----" << std::endl;
+			out << std::left << std::setw(32) << "timer" << std::right
+				<< std::setw(10) << "count" << std::setw(14) << "total ms"
+				<< std::setw(12) << "mean ms" << std::setw(12) << "min ms" << std::setw(12) << "max ms" << std::endl;
+			out << std::fixed << std::setprecision(3);
+			for (const auto &item : merged) {
+				const statistic &s = item.second;
+				if (s.phase != 'X') continue;
+				out << std::left << std::setw(32) << item.first << std::right
+					<< std::setw(10) << s.count << std::setw(14) << s.total * 1e-6
+					<< std::setw(12) << s.total * 1e-6 / s.count << std::setw(12) << s.min * 1e-6 << std::setw(12) << s.max * 1e-6 << std::endl;
+			}
+
+			out << std::left << std::setw(32) << "counter" << std::right
+				<< std::setw(10) << "count" << std::setw(14) << "sum"
+				<< std::setw(12) << "mean" << std::setw(12) << "min" << std::setw(12) << "max" << std::endl;
+			for (const auto &item : merged) {
+				const statistic &s = item.second;
+				if (s.phase != 'C') continue;
+				out << std::left << std::setw(32) << item.first << std::right
+					<< std::setw(10) << s.count << std::setw(14) << s.total
+					<< std::setw(12) << s.total / s.count << std::setw(12) << s.min << std::setw(12) << s.max << std::endl;
+			}
+
+			if (dropped > 0) {
+				out << "(" << dropped << " trace events dropped over the trace limit, summary is complete)" << std::endl;
+			}
+			out.copyfmt(state);
+		}
+	}
+}
@@ -0,0 +1,256 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// opencv
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+// project
+#include "parallel.hpp"
+
+
+namespace zhou {
+
+	// Where each pixel of the synthesis was taken from
+	//
+	// coords holds the example coordinates the pixel was sampled at (before seam
+	// removal), ids the placement that wrote it, numbered in placement order, and
+	// examples the example it was sampled from (its index in the library).
+	// Pixels that haven't been synthesized have NaN coordinates and an id and
+	// example of -1.
+	struct provenancemap {
+		cv::Mat coords;   // CV_32FC2
+		cv::Mat ids;      // CV_32SC1
+		cv::Mat examples; // CV_32SC1
+
+		provenancemap() { }
+
+		explicit provenancemap(cv::Size size)
+			: coords(size, CV_32FC2, cv::Scalar::all(std::numeric_limits<float>::quiet_NaN())),
+			ids(size, CV_32SC1, cv::Scalar(-1)),
+			examples(size, CV_32SC1, cv::Scalar(-1))
+		{ }
+
+		bool empty() const { return ids.empty(); }
+		cv::Size size() const { return ids.size(); }
+
+		// records a patch placed at pos, for the pixels where mask is set
+		// patchCoords are the example coordinates of each pixel of the patch
+		// (only the part of the patch inside the map is recorded)
+		void record(cv::Vec2i pos, const cv::Mat patchCoords, const cv::Mat mask, int id, int example = 0) {
+			using namespace cv;
+
+			assert(patchCoords.type() == CV_32FC2);
+			assert(mask.type() == CV_8UC1);
+			assert(patchCoords.size() == mask.size());
+
+			Rect area = Rect(Point(pos[0], pos[1]), mask.size()) & Rect(Point(0, 0), size());
+			for (int i = area.y; i < area.y + area.height; ++i) {
+				const Vec2f *c = patchCoords.ptr<Vec2f>(i - pos[1]);
+				const uchar *m = mask.ptr<uchar>(i - pos[1]);
+				Vec2f *oc = coords.ptr<Vec2f>(i);
+				int *oi = ids.ptr<int>(i);
+				int *oe = examples.ptr<int>(i);
+				for (int j = area.x; j < area.x + area.width; ++j) {
+					if (m[j - pos[0]]) {
+						oc[j] = c[j - pos[0]];
+						oi[j] = id;
+						oe[j] = example;
+					}
+				}
+			}
+		}
+	};
+
+
+	// example coordinates of a patch copied from the example at topleft
+	inline cv::Mat translationCoords(cv::Point topleft, cv::Size size) {
+		cv::Mat coords(size, CV_32FC2);
+		for (int i = 0; i < size.height; ++i) {
+			cv::Vec2f *c = coords.ptr<cv::Vec2f>(i);
+			for (int j = 0; j < size.width; ++j) {
+				c[j] = cv::Vec2f(float(topleft.x + j), float(topleft.y + i));
+			}
+		}
+		return coords;
+	}
+
+
+	// example coordinates for every pixel of a map scale times the size of the
+	// provenance map, in the coordinates of an example scale times as large
+	//
+	// Each pixel takes the placement of the nearest provenance pixel and
+	// continues that placement's mapping to its sub-pixel position, using the
+	// difference to a neighbour of the same placement as the local derivative
+	// (a copied patch has the identity, a rotated patch its rotation). Pixels
+	// with no placement get NaN coordinates.
+	inline cv::Mat resampleCoords(const provenancemap &provenance, cv::Size size, float scale) {
+		using namespace cv;
+		using namespace std;
+
+		assert(!provenance.empty());
+		const Mat &coords = provenance.coords;
+		const Mat &ids = provenance.ids;
+		const float nan = numeric_limits<float>::quiet_NaN();
+
+		// derivative of the example coordinates along x or y at p
+		auto derivative = [&](int i, int j, int di, int dj) {
+			int id = ids.at<int>(i, j);
+			int fi = i + di, fj = j + dj, bi = i - di, bj = j - dj;
+			if (fi < ids.rows && fj < ids.cols && ids.at<int>(fi, fj) == id) {
+				return coords.at<Vec2f>(fi, fj) - coords.at<Vec2f>(i, j);
+			}
+			if (bi >= 0 && bj >= 0 && ids.at<int>(bi, bj) == id) {
+				return coords.at<Vec2f>(i, j) - coords.at<Vec2f>(bi, bj);
+			}
+			return Vec2f(float(dj), float(di));
+		};
+
+		Mat map(size, CV_32FC2);
+		parallelFor(0, size.height, [&](int y) {
+			Vec2f *m = map.ptr<Vec2f>(y);
+			for (int x = 0; x < size.width; ++x) {
+				// pixel centers line up with the centers of the provenance map
+				Vec2f u((x + 0.5f) / scale - 0.5f, (y + 0.5f) / scale - 0.5f);
+				int j = min(max(cvRound(u[0]), 0), ids.cols - 1);
+				int i = min(max(cvRound(u[1]), 0), ids.rows - 1);
+				if (ids.at<int>(i, j) < 0) {
+					m[x] = Vec2f(nan, nan);
+					continue;
+				}
+				Vec2f d = u - Vec2f(float(j), float(i));
+				Vec2f c = coords.at<Vec2f>(i, j) + d[0] * derivative(i, j, 0, 1) + d[1] * derivative(i, j, 1, 0);
+				m[x] = (c + Vec2f(0.5f, 0.5f)) * scale - Vec2f(0.5f, 0.5f);
+			}
+		});
+		return map;
+	}
+
+
+	// Applies the decisions of a synthesis to other layers of its example
+	//
+	// Any raster that lines up with the example (land cover, masks, texture ids,
+	// of any type and channel count) is carried into the synthesis by gathering
+	// it through the example coordinates of the provenance map, one remap per
+	// layer. The coordinates are converted to OpenCV's fixed point maps once, so
+	// every layer after the first only pays for the gather.
+	//
+	// Layers are gathered as placed, without the seam removal the heights get,
+	// which is what categorical layers need (gather those with INTER_NEAREST).
+	//
+	// For a synthesis from several examples, the layers of each example are
+	// gathered with the layergather of that example, and are only valid where
+	// the synthesis was taken from it.
+	class layergather {
+	private:
+		cv::Mat m_coords;             // CV_32FC2, with 0 where there is nothing to gather
+		cv::Mat m_linear1, m_linear2; // fixed point maps for INTER_LINEAR
+		cv::Mat m_nearest;            // fixed point map for INTER_NEAREST
+		cv::Mat m_invalid;            // CV_8UC1, where there is nothing to gather
+
+		// coordinates of the pixels taken from example (every pixel if negative)
+		static cv::Mat exampleCoords(const provenancemap &provenance, float scale, int example) {
+			using namespace cv;
+			using namespace std;
+
+			Size size(cvRound(provenance.size().width * scale), cvRound(provenance.size().height * scale));
+			Mat coords = scale == 1 ? provenance.coords : resampleCoords(provenance, size, scale);
+			if (example < 0) return coords;
+			if (scale == 1) coords = coords.clone();
+
+			// each pixel belongs to the nearest provenance pixel, as in resampleCoords
+			const float nan = numeric_limits<float>::quiet_NaN();
+			for (int y = 0; y < size.height; ++y) {
+				Vec2f *c = coords.ptr<Vec2f>(y);
+				int i = min(max(cvRound((y + 0.5f) / scale - 0.5f), 0), provenance.size().height - 1);
+				const int *e = provenance.examples.ptr<int>(i);
+				for (int x = 0; x < size.width; ++x) {
+					int j = min(max(cvRound((x + 0.5f) / scale - 0.5f), 0), provenance.size().width - 1);
+					if (e[j] != example) c[x] = Vec2f(nan, nan);
+				}
+			}
+			return coords;
+		}
+
+	public:
+		layergather() { }
+
+		// coords are CV_32FC2 layer coordinates, NaN where there is nothing to gather
+		explicit layergather(const cv::Mat coords) {
+			using namespace cv;
+			using namespace std;
+
+			assert(coords.type() == CV_32FC2);
+
+			// remap has no notion of NaN coordinates
+			m_coords = coords.clone();
+			m_invalid = Mat(coords.size(), CV_8UC1, Scalar(0));
+			float extent = 0;
+			for (int i = 0; i < m_coords.rows; ++i) {
+				Vec2f *c = m_coords.ptr<Vec2f>(i);
+				uchar *v = m_invalid.ptr<uchar>(i);
+				for (int j = 0; j < m_coords.cols; ++j) {
+					if (isnan(c[j][0]) || isnan(c[j][1])) {
+						c[j] = Vec2f(0, 0);
+						v[j] = 1;
+					}
+					else {
+						extent = max(extent, max(abs(c[j][0]), abs(c[j][1])));
+					}
+				}
+			}
+
+			// fixed point maps address at most 16 bit coordinates
+			if (extent < numeric_limits<short>::max() - 1) {
+				convertMaps(m_coords, Mat(), m_linear1, m_linear2, CV_16SC2, false);
+				Mat unused;
+				convertMaps(m_coords, Mat(), m_nearest, unused, CV_16SC2, true);
+			}
+		}
+
+		// scale is the size of the layers relative to the example the provenance
+		// was recorded against, the result is the synthesis scaled by as much
+		// example selects the pixels taken from one example (-1 for all of them)
+		explicit layergather(const provenancemap &provenance, float scale = 1, int example = -1)
+			: layergather(exampleCoords(provenance, scale, example))
+		{ }
+
+		bool empty() const { return m_coords.empty(); }
+		cv::Size size() const { return m_coords.size(); }
+
+		// gathers the layer, fill is used where nothing was synthesized
+		cv::Mat apply(const cv::Mat layer, int interpolation = cv::INTER_NEAREST, cv::Scalar fill = cv::Scalar::all(0)) const {
+			using namespace cv;
+
+			assert(!empty());
+
+			Mat out;
+			if (interpolation == INTER_NEAREST && !m_nearest.empty()) {
+				remap(layer, out, m_nearest, Mat(), INTER_NEAREST, BORDER_REPLICATE);
+			}
+			else if (interpolation == INTER_LINEAR && !m_linear1.empty()) {
+				remap(layer, out, m_linear1, m_linear2, INTER_LINEAR, BORDER_REPLICATE);
+			}
+			else {
+				remap(layer, out, m_coords, Mat(), interpolation, BORDER_REPLICATE);
+			}
+			out.setTo(fill, m_invalid);
+			return out;
+		}
+
+		// gathers every layer with the same interpolation and fill
+		std::vector<cv::Mat> apply(const std::vector<cv::Mat> &layers, int interpolation = cv::INTER_NEAREST, cv::Scalar fill = cv::Scalar::all(0)) const {
+			std::vector<cv::Mat> out;
+			for (const cv::Mat &layer : layers) {
+				out.push_back(apply(layer, interpolation, fill));
+			}
+			return out;
+		}
+	};
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+// std
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+// opencv
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+// project
+#include "patchmerge.hpp"
+#include "profile.hpp"
+#include "provenance.hpp"
+
+
+namespace zhou {
+
+	// Regenerates a synthesis from a higher resolution version of its example
+	//
+	// The high resolution example is gathered through the provenance map, which
+	// reproduces the placed patches before seam removal. The seam removal of the
+	// original run is carried over as the (smooth) difference between the
+	// synthesis and the same gather from the original example, upsampled. What
+	// that can't carry is the sharp part of each seam at the new resolution, so
+	// the pixels within one source pixel of a change of placement get one more
+	// seam removal.
+	//
+	// hiresExample must be the example scaled by the same factor in both
+	// directions, the result is the synthesis scaled by that factor. The
+	// synthesis must have been made from that one example.
+	inline cv::Mat resampleSynthesis(const cv::Mat synthesis, const provenancemap &provenance, const cv::Mat examplemap, const cv::Mat hiresExample, int method = POISSON_LEAST_SQUARES) {
+		assert(synthesis.type() == CV_32FC1);
+		assert(examplemap.type() == CV_32FC1);
+		assert(hiresExample.type() == CV_32FC1);
+		assert(provenance.size() == synthesis.size());
+
+		using namespace cv;
+		using namespace std;
+
+		profile::scope prof("resample");
+
+		const float scale = float(hiresExample.cols) / examplemap.cols;
+		assert(abs(hiresExample.rows - examplemap.rows * scale) < 1);
+		const Size size(cvRound(synthesis.cols * scale), cvRound(synthesis.rows * scale));
+
+		// seam removal done by the original run
+		const Scalar nan = Scalar::all(numeric_limits<double>::quiet_NaN());
+		Mat correction = synthesis - layergather(provenance).apply(examplemap, INTER_LINEAR, nan);
+		patchNaNs(correction, 0);
+		Mat hiresCorrection;
+		resize(correction, hiresCorrection, size, 0, 0, INTER_LINEAR);
+
+		// gather at the new resolution
+		profile::scope prof_gather("resample.gather");
+		Mat result = layergather(provenance, scale).apply(hiresExample, INTER_LINEAR, nan) + hiresCorrection;
+		prof_gather.end();
+
+		// the placement of each pixel at the new resolution
+		Mat ids(size, CV_32SC1);
+		for (int y = 0; y < size.height; ++y) {
+			int *d = ids.ptr<int>(y);
+			int i = min(max(cvRound((y + 0.5f) / scale - 0.5f), 0), synthesis.rows - 1);
+			const int *s = provenance.ids.ptr<int>(i);
+			for (int x = 0; x < size.width; ++x) {
+				d[x] = s[min(max(cvRound((x + 0.5f) / scale - 0.5f), 0), synthesis.cols - 1)];
+			}
+		}
+
+		// seams are where the placement changes, the band around them is solved
+		// again with the rest of the map as the boundary
+		profile::scope prof_seams("resample.seams");
+		Mat seam_mask(size, CV_8UC1, Scalar(0));
+		auto markSeam = [&](int y0, int x0, int y1, int x1) {
+			int a = ids.at<int>(y0, x0), b = ids.at<int>(y1, x1);
+			if (a >= 0 && b >= 0 && a != b) {
+				seam_mask.at<uchar>(y0, x0) = 1;
+				seam_mask.at<uchar>(y1, x1) = 1;
+			}
+		};
+		for (int y = 0; y < size.height; ++y) {
+			for (int x = 0; x < size.width; ++x) {
+				if (x + 1 < size.width) markSeam(y, x, y, x + 1);
+				if (y + 1 < size.height) markSeam(y, x, y + 1, x);
+			}
+		}
+		int band = max(1, int(ceil(scale)));
+		Mat mask;
+		dilate(seam_mask, mask, Mat::ones(2 * band + 1, 2 * band + 1, CV_8UC1));
+		if (countNonZero(mask) > 0) {
+			poissonSeamRemoval(result, mask, seam_mask, method);
+		}
+		return result;
+	}
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+// std
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// opencv
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+// project
+#include "arena.hpp"
+#include "kernels.hpp"
+#include "parallel.hpp"
+
+
+namespace zhou {
+
+	// The example resampled at evenly spaced rotations
+	//
+	// A patch of the example rotated by any angle about any center is then an
+	// ROI of the image for the nearest angle, instead of being resampled from
+	// the example. The lookup is approximate: the angle is quantized to the
+	// bank spacing and the patch position is rounded to the nearest pixel of the
+	// rotated image (up to half a pixel off).
+	//
+	// Each image covers the whole rotated example with NaN outside of it, so the
+	// memory held is roughly angles * (width + height)^2 / 2 floats.
+	class rotationbank {
+	private:
+		std::vector<cv::Mat> m_images;
+		std::vector<cv::Vec2f> m_offsets; // where the example origin lands in each image
+
+		static cv::Vec2f rotate(cv::Vec2f v, float c, float s) {
+			return cv::Vec2f(c * v[0] - s * v[1], s * v[0] + c * v[1]);
+		}
+
+	public:
+		rotationbank() { }
+
+		rotationbank(const cv::Mat examplemap, int angles) {
+			assert(examplemap.type() == CV_32FC1);
+			assert(angles > 0);
+
+			using namespace cv;
+			using namespace std;
+
+			m_images.resize(angles);
+			m_offsets.resize(angles);
+			parallelFor(0, angles, [&](int k) {
+				float theta = angle(k);
+				float c = cos(theta), s = sin(theta);
+
+				// bounds of the example rotated the other way
+				const Vec2f corners[4] = {
+					Vec2f(0, 0), Vec2f(examplemap.cols - 1, 0),
+					Vec2f(0, examplemap.rows - 1), Vec2f(examplemap.cols - 1, examplemap.rows - 1)
+				};
+				Vec2f lo(numeric_limits<float>::infinity(), numeric_limits<float>::infinity()), hi = -lo;
+				for (const Vec2f &corner : corners) {
+					Vec2f u = rotate(corner, c, -s);
+					lo = Vec2f(min(lo[0], u[0]), min(lo[1], u[1]));
+					hi = Vec2f(max(hi[0], u[0]), max(hi[1], u[1]));
+				}
+				Vec2f o = -Vec2f(floor(lo[0]), floor(lo[1]));
+				Size size(int(ceil(hi[0] + o[0])) + 1, int(ceil(hi[1] + o[1])) + 1);
+
+				// image(u) = example(R(theta) (u - o))
+				Vec2f t = -rotate(o, c, s);
+				Mat m(2, 3, CV_64FC1);
+				m.at<double>(0, 0) = c; m.at<double>(0, 1) = -s; m.at<double>(0, 2) = t[0];
+				m.at<double>(1, 0) = s; m.at<double>(1, 1) = c;  m.at<double>(1, 2) = t[1];
+				warpAffine(examplemap, m_images[k], m, size, INTER_LINEAR | WARP_INVERSE_MAP, BORDER_CONSTANT, Scalar(numeric_limits<float>::quiet_NaN()));
+				m_offsets[k] = o;
+			});
+		}
+
+		bool empty() const { return m_images.empty(); }
+		int angles() const { return int(m_images.size()); }
+
+		float angle(int k) const {
+			return float(2 * CV_PI * k / angles());
+		}
+
+		int nearest(float theta) const {
+			int k = int(std::lround(theta / (2 * CV_PI) * angles())) % angles();
+			return k < 0 ? k + angles() : k;
+		}
+
+		size_t bytes() const {
+			size_t total = 0;
+			for (const cv::Mat &image : m_images) total += image.total() * image.elemSize();
+			return total;
+		}
+
+		// example coordinates sampled by lookup (the rotation and rounding applied)
+		// as a scratchMat
+		cv::Mat coordinates(float theta, cv::Vec2f center, int size) const {
+			using namespace cv;
+			using namespace std;
+
+			int k = nearest(theta);
+			float a = angle(k), c = cos(a), s = sin(a);
+			Vec2f topleft = m_offsets[k] + rotate(center, c, -s) - Vec2f(size / 2, size / 2);
+			Vec2f origin = Vec2f(cvRound(topleft[0]), cvRound(topleft[1])) - m_offsets[k];
+			Mat coords = scratchMat(size, size, CV_32FC2);
+			for (int i = 0; i < size; ++i) {
+				Vec2f *row = coords.ptr<Vec2f>(i);
+				for (int j = 0; j < size; ++j) {
+					row[j] = rotate(origin + Vec2f(j, i), c, s);
+				}
+			}
+			return coords;
+		}
+
+		// the size x size patch whose pixel p samples the example at
+		// center + R(theta) (p - size / 2), for theta rounded to the nearest angle
+		// returns false if the patch is not entirely inside the example
+		bool lookup(float theta, cv::Vec2f center, int size, cv::Mat &patch) const {
+			using namespace cv;
+			using namespace std;
+
+			int k = nearest(theta);
+			float a = angle(k);
+			Vec2f topleft = m_offsets[k] + rotate(center, cos(a), -sin(a)) - Vec2f(size / 2, size / 2);
+			Rect roi(cvRound(topleft[0]), cvRound(topleft[1]), size, size);
+			if ((roi & Rect(Point(0, 0), m_images[k].size())) != roi) return false;
+
+			m_images[k](roi).copyTo(patch);
+			return kernels::nanCount(patch.ptr<float>(), patch.total()) == 0;
+		}
+	};
+}
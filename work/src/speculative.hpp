@@ -0,0 +1,83 @@
+#pragma once
+
+// std
+#include <map>
+#include <mutex>
+#include <utility>
+
+// opencv
+#include <opencv2/core.hpp>
+
+
+namespace zhou {
+
+	// Results computed ahead of time for targets that haven't been placed yet
+	//
+	// Each result is stored with the window of the synthesis it was computed
+	// from. A result stays valid for as long as nothing is written inside that
+	// window, so every write to the synthesis must be reported with invalidate().
+	// A result taken from the cache is then exactly what computing it again would
+	// give. Storing, taking and invalidating are safe from any thread.
+	template <typename T>
+	class speculativecache {
+	private:
+		struct entry {
+			cv::Rect window;
+			T result;
+		};
+
+		mutable std::mutex m_mutex;
+		std::map<int, entry> m_entries;
+
+	public:
+		speculativecache() { }
+
+		void store(int key, cv::Rect window, T result) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_entries[key] = entry{ window, std::move(result) };
+		}
+
+		bool contains(int key) const {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_entries.count(key) > 0;
+		}
+
+		// moves the result for key into result and removes it
+		// returns false if there is no (valid) result for key
+		bool take(int key, T &result) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			auto it = m_entries.find(key);
+			if (it == m_entries.end()) return false;
+			result = std::move(it->second.result);
+			m_entries.erase(it);
+			return true;
+		}
+
+		// drops every result computed from pixels inside written
+		// returns the number of results dropped
+		int invalidate(cv::Rect written) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			int dropped = 0;
+			for (auto it = m_entries.begin(); it != m_entries.end();) {
+				if ((it->second.window & written).empty()) {
+					++it;
+				}
+				else {
+					it = m_entries.erase(it);
+					dropped++;
+				}
+			}
+			return dropped;
+		}
+
+		size_t size() const {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_entries.size();
+		}
+
+		void clear() {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_entries.clear();
+		}
+	};
+}
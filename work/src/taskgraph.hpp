@@ -0,0 +1,127 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// opencv
+#include <opencv2/core.hpp>
+
+// project
+#include "parallel.hpp"
+#include "profile.hpp"
+
+
+namespace zhou {
+
+	// Tasks with dependencies, run on OpenCV's thread pool
+	//
+	// A task starts as soon as every task it depends on has finished, so
+	// independent tasks overlap and the graph takes as long as its longest chain
+	// of dependencies (given enough threads). Tasks are added in an order where
+	// dependencies come first, which is also the order a single thread runs them
+	// in. Each task is timed under its name (a string literal, see profile.hpp).
+	//
+	// usage:
+	//   taskgraph tasks;
+	//   int a = tasks.add("a", [&] { ... });
+	//   int b = tasks.add("b", [&] { ... });
+	//   tasks.add("c", [&] { ... }, { a, b });
+	//   tasks.run();
+	class taskgraph {
+	private:
+		struct task {
+			const char *name;
+			std::function<void()> f;
+			std::vector<int> dependents;
+			int dependencies;
+		};
+
+		std::vector<task> m_tasks;
+
+	public:
+		taskgraph() { }
+
+		// returns the id to depend on the task with
+		int add(const char *name, std::function<void()> f, const std::vector<int> &dependencies = std::vector<int>()) {
+			int id = int(m_tasks.size());
+			m_tasks.push_back(task{ name, std::move(f), std::vector<int>(), int(dependencies.size()) });
+			for (int d : dependencies) {
+				assert(d >= 0 && d < id);
+				m_tasks[d].dependents.push_back(id);
+			}
+			return id;
+		}
+
+		size_t size() const { return m_tasks.size(); }
+
+		// runs every task and waits for them
+		// after a task throws no more tasks are started, and the first exception
+		// is rethrown once the tasks already running have finished
+		void run() {
+			using namespace std;
+
+			if (m_tasks.empty()) return;
+
+			mutex m;
+			condition_variable changed;
+			vector<int> remaining(m_tasks.size());
+			vector<int> ready; // taken from the back, so kept in reverse order of id
+			int running = 0, finished = 0;
+			exception_ptr error;
+			for (int i = int(m_tasks.size()) - 1; i >= 0; --i) {
+				remaining[i] = m_tasks[i].dependencies;
+				if (remaining[i] == 0) ready.push_back(i);
+			}
+
+			// every worker takes ready tasks until there are none left to run, a
+			// worker only waits while another is running a task, so the graph
+			// completes however many of the workers the pool actually runs at once
+			auto worker = [&](int) {
+				unique_lock<mutex> lock(m);
+				while (true) {
+					changed.wait(lock, [&] { return !ready.empty() || running == 0 || error; });
+					if (error || ready.empty()) break;
+
+					int id = ready.back();
+					ready.pop_back();
+					running++;
+					lock.unlock();
+
+					exception_ptr e;
+					try {
+						profile::scope prof(m_tasks[id].name);
+						m_tasks[id].f();
+					}
+					catch (...) {
+						e = current_exception();
+					}
+
+					lock.lock();
+					running--;
+					finished++;
+					if (e && !error) error = e;
+					if (!e) {
+						for (int d : m_tasks[id].dependents) {
+							if (--remaining[d] == 0) {
+								ready.push_back(d);
+							}
+						}
+						sort(ready.begin(), ready.end(), greater<int>());
+					}
+					changed.notify_all();
+				}
+			};
+			int workers = max(1, min(int(m_tasks.size()), cv::getNumThreads()));
+			parallelFor(0, workers, worker);
+
+			if (error) rethrow_exception(error);
+			assert(finished == int(m_tasks.size()));
+		}
+	};
+}
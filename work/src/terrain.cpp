@@ -1,8 +1,26 @@
 
 // std
+#include <cassert>
+#include <cctype>
+#include <charconv>
+#include <cmath>
 #include <iostream>
 #include <fstream>
+#include <mutex>
 #include <string>
+#include <vector>
+
+// memory mapping
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // project
 #include "terrain.hpp"
@@ -10,11 +28,15 @@
 // tiff
 #include <tiffio.h>
 #include <geotiffio.h>
+#include <xtiffio.h>
 
 // opencv
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
 
+// project
+#include "parallel.hpp"
+
 
 using namespace std;
 using namespace cv;
@@ -22,149 +44,498 @@ using namespace cv;
 // helper methods
 namespace {
 
+	// read-only mapping of an entire file
+	// data() is null if the file could not be mapped
+	class filemapping {
+	private:
+		const unsigned char *m_data = nullptr;
+		size_t m_size = 0;
+#ifdef _WIN32
+		HANDLE m_file = INVALID_HANDLE_VALUE;
+		HANDLE m_mapping = NULL;
+#endif
+
+	public:
+		explicit filemapping(const std::string &filename) {
+#ifdef _WIN32
+			m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (m_file == INVALID_HANDLE_VALUE) return;
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) return;
+			m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (m_mapping == NULL) return;
+			m_data = static_cast<const unsigned char *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+			if (m_data) m_size = size_t(size.QuadPart);
+#else
+			int fd = open(filename.c_str(), O_RDONLY);
+			if (fd < 0) return;
+			struct stat st;
+			if (fstat(fd, &st) == 0 && st.st_size > 0) {
+				void *p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+				if (p != MAP_FAILED) {
+					m_data = static_cast<const unsigned char *>(p);
+					m_size = size_t(st.st_size);
+				}
+			}
+			close(fd); // the mapping keeps the file referenced
+#endif
+		}
 
+		~filemapping() {
+#ifdef _WIN32
+			if (m_data) UnmapViewOfFile(m_data);
+			if (m_mapping != NULL) CloseHandle(m_mapping);
+			if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+#else
+			if (m_data) munmap(const_cast<unsigned char *>(m_data), m_size);
+#endif
+		}
 
-}
-
-namespace zhou {
-
-	terrain terrainReadImage(const std::string &filename, double minVal, double maxVal, double spacing) {
-		Mat img = imread(filename, CV_LOAD_IMAGE_GRAYSCALE);
-
-		double vmin, vmax;
-		minMaxIdx(img, &vmin, &vmax);
-		double s = (maxVal - minVal) / (vmax - vmin);
-
-		Mat basic_terrain;
-		img.convertTo(basic_terrain, CV_32FC1, s, minVal-(s*vmin));
-
-		return terrain(basic_terrain, spacing);
-	}
-
-
-
-	// we make a huge number of assumuptions loading this data 
-	// so we don't have to deal with the enormous number of cases
-	// TODO list assumptions
-	terrain terrainReadTIFF(const std::string &filename) {
+		filemapping(const filemapping &) = delete;
+		filemapping & operator=(const filemapping &) = delete;
 
+		const unsigned char * data() const { return m_data; }
+		size_t size() const { return m_size; }
+	};
 
-		TIFF *tif;
 
-		// Open the TIFF image for reading
-		if ((tif = TIFFOpen(filename.c_str(), "r")) == NULL) {
+	// opened through libxtiff so the GeoTIFF tags are registered with their proper types
+	TIFF * openTIFF(const std::string &filename) {
+		TIFF *tif = XTIFFOpen(filename.c_str(), "r");
+		if (tif == NULL) {
 			cerr << "File not found : " << filename << endl;
 			throw runtime_error("File not found");
 		}
+		return tif;
+	}
 
+
+	// determine matrix type of a single sample TIFF
+	int tiffMatType(TIFF *tif) {
 		// Extract the 'sample' details for the TIFF
 		uint16 bitsPerSample;        // normally 8 for grayscale image or 16 for heightmaps
 		uint16 samplesPerPixel;      // normally 1 for grayscale image
 		uint16 sampleFormat;         // should only be 1 for heightmaps
-		TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
-		TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel);
-		TIFFGetField(tif, TIFFTAG_SAMPLEFORMAT, &sampleFormat); // extension
+		TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
+		TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel);
+		TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &sampleFormat); // extension
+
+		if (samplesPerPixel != 1) {
+			cerr << "Invalid samplesPerPixel=" << samplesPerPixel << endl;
+			throw runtime_error("Only single sample TIFFs are supported.");
+		}
 
 		// determine matrix type (with bitshift magic)
-		int mattype = 0;
 		const int ls = 3; // number of bits to left shift by
 		switch ((bitsPerSample << ls) | sampleFormat) {
-		case (8 << ls) | SAMPLEFORMAT_INT: mattype = CV_8S; break;
-		case (16 << ls) | SAMPLEFORMAT_INT: mattype = CV_16S; break;
-		case (32 << ls) | SAMPLEFORMAT_INT: mattype = CV_32S; break;
+		case (8 << ls) | SAMPLEFORMAT_INT: return CV_8S;
+		case (16 << ls) | SAMPLEFORMAT_INT: return CV_16S;
+		case (32 << ls) | SAMPLEFORMAT_INT: return CV_32S;
 
-		case (8 << ls) | SAMPLEFORMAT_UINT: mattype = CV_8U; break;
-		case (16 << ls) | SAMPLEFORMAT_UINT: mattype = CV_16U; break;
+		case (8 << ls) | SAMPLEFORMAT_UINT: return CV_8U;
+		case (16 << ls) | SAMPLEFORMAT_UINT: return CV_16U;
 
-		case (32 << ls) | SAMPLEFORMAT_IEEEFP: mattype = CV_32F; break;
-		case (64 << ls) | SAMPLEFORMAT_IEEEFP: mattype = CV_64F; break;
+		case (32 << ls) | SAMPLEFORMAT_IEEEFP: return CV_32F;
+		case (64 << ls) | SAMPLEFORMAT_IEEEFP: return CV_64F;
 
 		default: // image reading error
 			cerr << "Invalid bitsPerSample=" << bitsPerSample << " and sampleFormat=" << sampleFormat << endl;
 			throw runtime_error("Invalid bitsPerSample and sampleFormat combination.");
-			break;
 		}
+	}
 
 
-
-		// get sizes and create image
-		uint32 rows, cols;
-		TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &rows);
-		TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &cols);
-		Mat heightmap(rows, cols, mattype);
-
-		//allocate memory for reading tif image
-		tdata_t raw_scanline = _TIFFmalloc(TIFFScanlineSize(tif));
-		if (raw_scanline == NULL); // fatal error
-
-		// reinterpret data as the right type
-		int row_byte_size = (bitsPerSample * cols) / 8;
-		for (uint32 row = 0; row < rows; row++) {
-			//TIFFReadScanline(tif, raw_scanline, rows - row - 1);
-			TIFFReadScanline(tif, raw_scanline, row);
-			memcpy(heightmap.ptr(row), raw_scanline, row_byte_size);
+	template <typename T>
+	std::vector<T> tiffGetArray(TIFF *tif, ttag_t tag) {
+		uint16 count = 0; // XTIFF registers the geotiff tags with 16-bit counts
+		T *data = nullptr;
+		if (TIFFGetField(tif, tag, &count, &data) && data != nullptr) {
+			return std::vector<T>(data, data + count);
 		}
-
-		_TIFFfree(raw_scanline); //free allocate memory
-
-
+		return {};
+	}
 
 
+	zhou::geotags readGeoTags(TIFF *tif) {
 		//ModelPixelScaleTag     = 33550 (SoftDesk)
 		//ModelTransformationTag = 33920 (Intergraph)
 		//ModelTiepointTag       = 33922 (Intergraph)
-		const int TIFFTAG_MODELPIXELSCALE = 33550;
-		const int TIFFTAG_MODELTIEPOINT = 33922;
+		zhou::geotags geo;
+		geo.pixelScale = tiffGetArray<double>(tif, TIFFTAG_GEOPIXELSCALE);
+		geo.tiepoints = tiffGetArray<double>(tif, TIFFTAG_GEOTIEPOINTS);
+		geo.keyDirectory = tiffGetArray<uint16_t>(tif, TIFFTAG_GEOKEYDIRECTORY);
+		geo.doubleParams = tiffGetArray<double>(tif, TIFFTAG_GEODOUBLEPARAMS);
+		char *ascii = nullptr;
+		if (TIFFGetField(tif, TIFFTAG_GEOASCIIPARAMS, &ascii) && ascii != nullptr) {
+			geo.asciiParams = ascii;
+		}
+		return geo;
+	}
+
 
+	void writeGeoTags(TIFF *tif, const zhou::geotags &geo) {
+		if (!geo.pixelScale.empty())
+			TIFFSetField(tif, TIFFTAG_GEOPIXELSCALE, uint16(geo.pixelScale.size()), geo.pixelScale.data());
+		if (!geo.tiepoints.empty())
+			TIFFSetField(tif, TIFFTAG_GEOTIEPOINTS, uint16(geo.tiepoints.size()), geo.tiepoints.data());
+		if (!geo.keyDirectory.empty())
+			TIFFSetField(tif, TIFFTAG_GEOKEYDIRECTORY, uint16(geo.keyDirectory.size()), geo.keyDirectory.data());
+		if (!geo.doubleParams.empty())
+			TIFFSetField(tif, TIFFTAG_GEODOUBLEPARAMS, uint16(geo.doubleParams.size()), geo.doubleParams.data());
+		if (!geo.asciiParams.empty())
+			TIFFSetField(tif, TIFFTAG_GEOASCIIPARAMS, geo.asciiParams.c_str());
+	}
 
-		uint64 count; // HACK formally unint16 but had stack corruption so relying on little eindian
-		double *data;
 
-		TIFFGetField(tif, TIFFTAG_MODELPIXELSCALE, &count, &data);
-		Vec3d modelscale{ data[0], data[1], data[2] };
+	// sample spacing in meters from the model pixel scale
+	double geoSpacing(const zhou::geotags &geo) {
+		if (geo.pixelScale.size() < 2) return 1;
 
 		// first 2 components (spacing converted from degrees to meters)
 		// 1 degree = 110km (approx)
-		Vec2d spacing = Vec2d{ modelscale[0], modelscale[1] } * 110000; 
+		Vec2d spacing = Vec2d{ geo.pixelScale[0], geo.pixelScale[1] } * 110000;
+		return spacing[0];
+	}
 
 
+	// in-memory TIFF used to encode single tiles with libtiff's own codecs
+	// so tiles can be compressed concurrently and written raw afterwards
+	struct memorytiff {
+		std::vector<unsigned char> buffer;
+		toff_t position = 0;
 
+		static tmsize_t read(thandle_t h, void *data, tmsize_t size) {
+			memorytiff &m = *reinterpret_cast<memorytiff *>(h);
+			tmsize_t n = std::max<tmsize_t>(0, std::min<tmsize_t>(size, tmsize_t(m.buffer.size()) - tmsize_t(m.position)));
+			if (n > 0) memcpy(data, m.buffer.data() + m.position, n);
+			m.position += n;
+			return n;
+		}
 
-		//// resize to a square if need be
-		//if (spacing.x != spacing.y) {
-		//	//TODO resize
-		//	spacing.x = spacing.y = min(spacing.x, spacing.y);
-		//}
+		static tmsize_t write(thandle_t h, void *data, tmsize_t size) {
+			memorytiff &m = *reinterpret_cast<memorytiff *>(h);
+			if (m.position + size > m.buffer.size()) m.buffer.resize(m.position + size);
+			memcpy(m.buffer.data() + m.position, data, size);
+			m.position += size;
+			return size;
+		}
 
+		static toff_t seek(thandle_t h, toff_t offset, int whence) {
+			memorytiff &m = *reinterpret_cast<memorytiff *>(h);
+			switch (whence) {
+			case SEEK_SET: m.position = offset; break;
+			case SEEK_CUR: m.position += offset; break;
+			case SEEK_END: m.position = m.buffer.size() + offset; break;
+			}
+			return m.position;
+		}
 
-		//if (modelscale.z > 0.0) {
-		//	t *= modelscale.z;
-		//}
+		static int close(thandle_t) { return 0; }
+		static toff_t size(thandle_t h) { return reinterpret_cast<memorytiff *>(h)->buffer.size(); }
+		static int map(thandle_t, void **, toff_t *) { return 0; }
+		static void unmap(thandle_t, void *, toff_t) { }
+	};
 
 
+	inline bool iswhitespace(char c) {
+		return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+	}
+
 
-		// TODO for later
-		// adding a base resolution etc look up geotiff example for elevation maps
-		//TIFFGetField(tif, TIFFTAG_MODELTIEPOINT, &count, &data);
-		//vector<dvec3> model_ties;
-		//for (uint16 i = 0; i < count / 3; ++i) {
-		//	model_ties.emplace_back(data[3 * i + 0], data[3 * i + 1] , data[3 * i + 2]);
-		//}
+	// moves p forward to the next whitespace (or the end)
+	const char * nextspace(const char *p, const char *end) {
+		while (p < end && !iswhitespace(*p)) ++p;
+		return p;
+	}
 
 
-		//// geotiff stuff
-		//GTIF *gtif = GTIFNew(tif);
-		//GTIFKeyGet(gtif, something);
-		//GTIFFree(gtif);
+	// number of whitespace separated tokens in [p, end)
+	size_t counttokens(const char *p, const char *end) {
+		size_t count = 0;
+		bool inspace = true;
+		for (; p < end; ++p) {
+			bool s = iswhitespace(*p);
+			count += inspace && !s;
+			inspace = s;
+		}
+		return count;
+	}
 
 
-		// close TIFF
+	// parses every token in [p, end) as a float into out
+	void parsefloats(const char *p, const char *end, float *out, float nodata) {
+		while (p < end) {
+			while (p < end && iswhitespace(*p)) ++p;
+			if (p == end) break;
+			if (*p == '+') ++p; // not accepted by from_chars
+			float v;
+			auto r = std::from_chars(p, end, v);
+			if (r.ec != std::errc() || (r.ptr < end && !iswhitespace(*r.ptr))) {
+				throw runtime_error("Invalid value in ASCII grid.");
+			}
+			*out++ = (v == nodata) ? numeric_limits<float>::quiet_NaN() : v;
+			p = r.ptr;
+		}
+	}
+
+
+	void setFloatTileFields(TIFF *tif, uint32 cols, uint32 rows, uint32 tileSize, uint16 compression) {
+		TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, cols);
+		TIFFSetField(tif, TIFFTAG_IMAGELENGTH, rows);
+		TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 32);
+		TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+		TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+		TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+		TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+		TIFFSetField(tif, TIFFTAG_TILEWIDTH, tileSize);
+		TIFFSetField(tif, TIFFTAG_TILELENGTH, tileSize);
+		TIFFSetField(tif, TIFFTAG_COMPRESSION, compression);
+		TIFFSetField(tif, TIFFTAG_PREDICTOR, PREDICTOR_FLOATINGPOINT);
+	}
+
+
+	// compress a single full-sized (CV_32FC1, tileSize x tileSize) tile
+	std::vector<unsigned char> encodeFloatTile(Mat tile, uint32 tileSize, uint16 compression) {
+		assert(tile.isContinuous());
+		memorytiff m;
+		TIFF *tif = TIFFClientOpen("tile", "w", reinterpret_cast<thandle_t>(&m),
+			memorytiff::read, memorytiff::write, memorytiff::seek, memorytiff::close,
+			memorytiff::size, memorytiff::map, memorytiff::unmap);
+		if (tif == NULL) throw runtime_error("Failed to create in-memory TIFF.");
+
+		setFloatTileFields(tif, tileSize, tileSize, tileSize, compression);
+		if (TIFFWriteEncodedTile(tif, 0, tile.data, tile.total() * tile.elemSize()) < 0) {
+			TIFFClose(tif);
+			throw runtime_error("Failed to encode TIFF tile.");
+		}
+
+		uint64 *offsets = nullptr, *bytecounts = nullptr;
+		TIFFGetField(tif, TIFFTAG_TILEOFFSETS, &offsets);
+		TIFFGetField(tif, TIFFTAG_TILEBYTECOUNTS, &bytecounts);
+		std::vector<unsigned char> encoded(m.buffer.begin() + offsets[0], m.buffer.begin() + offsets[0] + bytecounts[0]);
 		TIFFClose(tif);
+		return encoded;
+	}
+
+}
+
+namespace zhou {
+
+	terrain terrainReadImage(const std::string &filename, double minVal, double maxVal, double spacing) {
+		Mat img = imread(filename, CV_LOAD_IMAGE_GRAYSCALE);
+
+		double vmin, vmax;
+		minMaxIdx(img, &vmin, &vmax);
+		double s = (maxVal - minVal) / (vmax - vmin);
 
+		Mat basic_terrain;
+		img.convertTo(basic_terrain, CV_32FC1, s, minVal-(s*vmin));
 
-		Mat float_heightmap(heightmap.rows, heightmap.cols, CV_32F);
-		heightmap.convertTo(float_heightmap, CV_32F);
-		return terrain(float_heightmap, spacing[0]);
+		return terrain(basic_terrain, spacing);
+	}
+
+
+
+	struct terrainTIFFReader::impl {
+		std::string filename;
+		TIFF *tif = nullptr; // metadata handle
+
+		// libtiff handles are not thread safe, so each concurrent decode
+		// borrows its own handle, opening more as needed
+		std::mutex mutex;
+		std::vector<TIFF *> idle;
+
+		int mattype = 0;
+		size_t pixelBytes = 0;
+		uint32 rows = 0, cols = 0;
+		geotags geo;
+
+		// strips are treated as tiles that span the full width
+		bool tiled = false;
+		uint32 blockWidth = 0, blockHeight = 0;
+		uint32 blocksAcross = 0;
+		size_t blockBytes = 0; // decoded size of a full strip/tile
+
+		// zero-copy access for uncompressed data
+		std::unique_ptr<filemapping> map;
+		std::vector<uint64> offsets;
+		bool mapped = false;
+
+		TIFF * acquire() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!idle.empty()) {
+					TIFF *t = idle.back();
+					idle.pop_back();
+					return t;
+				}
+			}
+			return openTIFF(filename);
+		}
+
+		void release(TIFF *t) {
+			std::lock_guard<std::mutex> lock(mutex);
+			idle.push_back(t);
+		}
+
+		~impl() {
+			for (TIFF *t : idle) TIFFClose(t);
+			if (tif) TIFFClose(tif);
+		}
+	};
+
+
+	terrainTIFFReader::terrainTIFFReader(const std::string &filename) : m_impl(new impl) {
+		impl &d = *m_impl;
+		d.filename = filename;
+		d.tif = openTIFF(filename);
+		d.mattype = tiffMatType(d.tif);
+		d.pixelBytes = CV_ELEM_SIZE(d.mattype);
+		d.geo = readGeoTags(d.tif);
+		TIFFGetField(d.tif, TIFFTAG_IMAGELENGTH, &d.rows);
+		TIFFGetField(d.tif, TIFFTAG_IMAGEWIDTH, &d.cols);
+
+		d.tiled = TIFFIsTiled(d.tif);
+		if (d.tiled) {
+			TIFFGetField(d.tif, TIFFTAG_TILEWIDTH, &d.blockWidth);
+			TIFFGetField(d.tif, TIFFTAG_TILELENGTH, &d.blockHeight);
+			d.blockBytes = TIFFTileSize(d.tif);
+		}
+		else {
+			d.blockWidth = d.cols;
+			TIFFGetFieldDefaulted(d.tif, TIFFTAG_ROWSPERSTRIP, &d.blockHeight);
+			d.blockHeight = std::min(d.blockHeight, d.rows);
+			d.blockBytes = TIFFStripSize(d.tif);
+		}
+		d.blocksAcross = (d.cols + d.blockWidth - 1) / d.blockWidth;
+
+		// uncompressed, native byte order data can be used in-place
+		uint16 compression = COMPRESSION_NONE;
+		TIFFGetFieldDefaulted(d.tif, TIFFTAG_COMPRESSION, &compression);
+		if (compression == COMPRESSION_NONE && !TIFFIsByteSwapped(d.tif)) {
+			uint64 *offsets = nullptr, *bytecounts = nullptr;
+			uint32 blocks = d.tiled ? TIFFNumberOfTiles(d.tif) : TIFFNumberOfStrips(d.tif);
+			bool ok = d.tiled ?
+				TIFFGetField(d.tif, TIFFTAG_TILEOFFSETS, &offsets) && TIFFGetField(d.tif, TIFFTAG_TILEBYTECOUNTS, &bytecounts) :
+				TIFFGetField(d.tif, TIFFTAG_STRIPOFFSETS, &offsets) && TIFFGetField(d.tif, TIFFTAG_STRIPBYTECOUNTS, &bytecounts);
+			if (ok && offsets && bytecounts) {
+				d.map.reset(new filemapping(filename));
+				uint64 blockBytes = uint64(d.blockWidth) * d.blockHeight * d.pixelBytes;
+				ok = d.map->data() != nullptr;
+				for (uint32 b = 0; ok && b < blocks; ++b) {
+					ok = bytecounts[b] >= blockBytes && offsets[b] + blockBytes <= d.map->size();
+					// the last strip may be short
+					if (!ok && !d.tiled && b == blocks - 1) {
+						uint64 lastBytes = uint64(d.rows - b * d.blockHeight) * d.blockWidth * d.pixelBytes;
+						ok = bytecounts[b] >= lastBytes && offsets[b] + lastBytes <= d.map->size();
+					}
+				}
+				if (ok) {
+					d.offsets.assign(offsets, offsets + blocks);
+					d.mapped = true;
+				}
+				else {
+					d.map.reset();
+				}
+			}
+		}
+	}
+
+
+	terrainTIFFReader::~terrainTIFFReader() { }
+
+
+	cv::Size terrainTIFFReader::size() const {
+		return Size(m_impl->cols, m_impl->rows);
+	}
+
+
+	double terrainTIFFReader::spacing() const {
+		return geoSpacing(m_impl->geo);
+	}
+
+
+	const geotags & terrainTIFFReader::geo() const {
+		return m_impl->geo;
+	}
+
+
+	bool terrainTIFFReader::mapped() const {
+		return m_impl->mapped;
+	}
+
+
+	cv::Mat terrainTIFFReader::read(cv::Rect window) const {
+		impl &d = *m_impl;
+		Mat out(window.size(), CV_32FC1, Scalar(numeric_limits<float>::quiet_NaN()));
+		Rect r = window & Rect(0, 0, d.cols, d.rows);
+		if (r.empty()) return out;
+
+		// every strip/tile intersecting the window
+		const int bx0 = r.x / d.blockWidth, bx1 = (r.x + r.width - 1) / d.blockWidth;
+		const int by0 = r.y / d.blockHeight, by1 = (r.y + r.height - 1) / d.blockHeight;
+		const int across = bx1 - bx0 + 1;
+		const int blocks = across * (by1 - by0 + 1);
+		const size_t stride = d.blockWidth * d.pixelBytes;
+
+		// each block is decoded (or found in the mapping) and converted
+		// straight into its part of the window, so there is no full-size
+		// intermediate in the source type
+		auto readblock = [&](int b) {
+			int bx = bx0 + b % across;
+			int by = by0 + b / across;
+			Rect block(bx * d.blockWidth, by * d.blockHeight, d.blockWidth, d.blockHeight);
+			Rect isect = block & r;
+			uint32 index = by * d.blocksAcross + bx; // single plane tile/strip index
+
+			const unsigned char *data;
+			thread_local std::vector<unsigned char> scratch;
+			if (d.mapped) {
+				data = d.map->data() + d.offsets[index];
+			}
+			else {
+				scratch.resize(d.blockBytes);
+				TIFF *t = d.acquire();
+				tmsize_t read = d.tiled ?
+					TIFFReadEncodedTile(t, index, scratch.data(), scratch.size()) :
+					TIFFReadEncodedStrip(t, index, scratch.data(), scratch.size());
+				d.release(t);
+				if (read < 0) throw runtime_error("Failed to decode TIFF strip/tile.");
+				data = scratch.data();
+			}
+
+			const unsigned char *first = data + (isect.y - block.y) * stride + (isect.x - block.x) * d.pixelBytes;
+			Mat src(isect.height, isect.width, d.mattype, const_cast<unsigned char *>(first), stride);
+			Mat dst = out(isect - window.tl());
+			src.convertTo(dst, CV_32F);
+		};
+
+		if (blocks == 1) readblock(0);
+		else parallelFor(0, blocks, readblock);
+
+		return out;
+	}
+
+
+	terrain terrainReadTIFF(const std::string &filename, cv::Rect window) {
+		terrainTIFFReader reader(filename);
+		terrain ter(reader.read(window), reader.spacing());
+		ter.geo = reader.geo();
+		return ter;
+	}
+
+
+	// we make a number of assumptions loading this data so we don't have to
+	// deal with the enormous number of cases:
+	//  - a single sample per pixel (no multi-band rasters)
+	//  - the first directory (no overviews)
+	//  - spacing taken from the model pixel scale, in degrees
+	// strips/tiles are decoded concurrently, see terrainTIFFReader
+	terrain terrainReadTIFF(const std::string &filename) {
+		terrainTIFFReader reader(filename);
+		terrain ter(reader.read(Rect(Point(0, 0), reader.size())), reader.spacing());
+		ter.geo = reader.geo();
+		return ter;
 	}
 
 
@@ -187,26 +558,217 @@ namespace zhou {
 	// https://en.wikipedia.org/wiki/Esri_grid
 	// AKA ARC/INFO ASCII GRID
 	// *.asc
+	//
+	// the file is mapped and split into chunks at whitespace, values are counted
+	// per chunk then parsed concurrently straight into the heightmap
+	// NODATA_value samples become NaN
+	terrain terrainReadTxt(const std::string &filename) {
+		filemapping map(filename);
+		if (!map.data()) {
+			cerr << "File not found : " << filename << endl;
+			throw runtime_error("File not found");
+		}
+		const char *p = reinterpret_cast<const char *>(map.data());
+		const char *end = p + map.size();
+
+		// meta-data, "key value" pairs until the first numeric token
+		// (which can start with a letter, as nan or inf)
+		int rows = -1, cols = -1;
+		double cellsize = 1;
+		float nodata = numeric_limits<float>::quiet_NaN(); // never equal, so no NODATA unless given
+		while (true) {
+			while (p < end && iswhitespace(*p)) ++p;
+			if (p == end || !isalpha(static_cast<unsigned char>(*p))) break;
+			const char *keyend = nextspace(p, end);
+			double number;
+			auto numeric = std::from_chars(p, keyend, number);
+			if (numeric.ec == std::errc() && numeric.ptr == keyend) break;
+			string key(p, keyend);
+			for (char &c : key) c = char(tolower(static_cast<unsigned char>(c)));
+			p = keyend;
+			while (p < end && iswhitespace(*p)) ++p;
+			const char *valueend = nextspace(p, end);
+			double value = 0;
+			if (std::from_chars(p, valueend, value).ec != std::errc()) {
+				throw runtime_error("Invalid header value in ASCII grid.");
+			}
+			p = valueend;
+
+			if (key == "ncols") cols = int(value);
+			else if (key == "nrows") rows = int(value);
+			else if (key == "cellsize") cellsize = value;
+			else if (key == "nodata_value") nodata = float(value);
+			// xllcorner/yllcorner/xllcenter/yllcenter are not used
+		}
+		if (rows <= 0 || cols <= 0) {
+			throw runtime_error("ASCII grid is missing ncols/nrows.");
+		}
+
+		// split the data into chunks that start on whitespace
+		const int chunks = std::max(1, 4 * cv::getNumberOfCPUs());
+		vector<const char *> bounds(chunks + 1);
+		bounds[0] = p;
+		bounds[chunks] = end;
+		for (int c = 1; c < chunks; ++c) {
+			bounds[c] = std::max(bounds[c - 1], nextspace(p + (end - p) * c / chunks, end));
+		}
+
+		// count values in each chunk to know where its first value goes
+		vector<size_t> first(chunks + 1, 0);
+		parallelFor(0, chunks, [&](int c) {
+			first[c + 1] = counttokens(bounds[c], bounds[c + 1]);
+		});
+		for (int c = 0; c < chunks; ++c) first[c + 1] += first[c];
+		if (first[chunks] != size_t(rows) * cols) {
+			cerr << "Expected " << size_t(rows) * cols << " values, found " << first[chunks] << endl;
+			throw runtime_error("ASCII grid size does not match its header.");
+		}
+
+		// parse
+		Mat heightmap(rows, cols, CV_32FC1);
+		float *data = heightmap.ptr<float>();
+		parallelFor(0, chunks, [&](int c) {
+			parsefloats(bounds[c], bounds[c + 1], data + first[c], nodata);
+		});
+
+		return terrain(heightmap, cellsize);
+	}
+
+
+	// Esri grid format
+	// https://en.wikipedia.org/wiki/Esri_grid
+	// AKA ARC/INFO ASCII GRID
+	// *.asc
+	//
+	// rows are formatted concurrently in bands (shortest round-trip floats)
+	// and each band is written with a single sequential write
+	// NaN samples are written as NODATA_value
 	void terrainWriteTxt(const std::string &filename, terrain ter) {
-		std::ofstream outfile;
-		outfile.open(filename);
+		assert(ter.heightmap.type() == CV_32FC1);
+
+		const int rows = ter.heightmap.rows;
+		const int cols = ter.heightmap.cols;
+		const float nodata = -9999;
+
+		std::ofstream outfile(filename, std::ios::binary);
+		if (!outfile) {
+			cerr << "Could not open file for writing : " << filename << endl;
+			throw runtime_error("Could not open file for writing");
+		}
 
 		// meta-data
-		outfile << "ncols        " << ter.heightmap.cols << endl;
-		outfile << "nrows        " << ter.heightmap.cols << endl;
-		outfile << "xllcorner    0.0" << endl;
-		outfile << "yllcorner    0.0" << endl;
-		outfile << "cellsize     " << ter.spacing << endl;
+		char cellsize[32];
+		*std::to_chars(cellsize, cellsize + sizeof(cellsize) - 1, ter.spacing).ptr = '\0';
+		outfile << "ncols        " << cols << "\n";
+		outfile << "nrows        " << rows << "\n";
+		outfile << "xllcorner    0.0" << "\n";
+		outfile << "yllcorner    0.0" << "\n";
+		outfile << "cellsize     " << cellsize << "\n";
+		outfile << "NODATA_value " << nodata << "\n";
 
 		// data
-		for (int i = 0; i < ter.heightmap.rows; i++) {
-			outfile << ter.heightmap.at<float>(i, 0);
-			for (int j = 1; j < ter.heightmap.cols; j++) {
-				outfile << " " << ter.heightmap.at<float>(i, j);
+		const size_t maxValueBytes = 16; // shortest round-trip float is at most 15 characters, plus separator
+		const size_t maxRowBytes = cols * maxValueBytes + 1;
+		const int bandRows = std::max<int>(1, int((size_t(8) << 20) / maxRowBytes)); // ~8MB per band
+		const int bandsPerPass = std::max(1, cv::getNumberOfCPUs());
+		vector<vector<char>> buffers(bandsPerPass);
+		vector<size_t> lengths(bandsPerPass);
+
+		for (int first = 0; first < rows; first += bandRows * bandsPerPass) {
+			int bands = std::min(bandsPerPass, (rows - first + bandRows - 1) / bandRows);
+
+			parallelFor(0, bands, [&](int b) {
+				int start = first + b * bandRows;
+				int end = std::min(rows, start + bandRows);
+				vector<char> &buffer = buffers[b];
+				buffer.resize((end - start) * maxRowBytes);
+
+				char *p = buffer.data();
+				char *last = buffer.data() + buffer.size();
+				for (int i = start; i < end; i++) {
+					const float *row = ter.heightmap.ptr<float>(i);
+					for (int j = 0; j < cols; j++) {
+						if (j > 0) *p++ = ' ';
+						p = std::to_chars(p, last, std::isfinite(row[j]) ? row[j] : nodata).ptr;
+					}
+					*p++ = '\n';
+				}
+				lengths[b] = p - buffer.data();
+			});
+
+			for (int b = 0; b < bands; ++b) {
+				outfile.write(buffers[b].data(), lengths[b]);
+			}
+		}
+
+		if (!outfile) {
+			cerr << "Failed writing : " << filename << endl;
+			throw runtime_error("Failed writing file");
+		}
+	}
+
+
+	// 32-bit float tiled GeoTIFF, DEFLATE compressed (LZW if libtiff was built
+	// without zlib) with the floating point predictor
+	// tiles are encoded concurrently a band at a time, then written sequentially
+	void terrainWriteTIFF(const std::string &filename, terrain ter) {
+		assert(ter.heightmap.type() == CV_32FC1);
+
+		const uint32 tileSize = 256;
+		const uint32 rows = ter.heightmap.rows;
+		const uint32 cols = ter.heightmap.cols;
+		const uint32 tilesAcross = (cols + tileSize - 1) / tileSize;
+		const uint32 tilesDown = (rows + tileSize - 1) / tileSize;
+
+		uint16 compression = COMPRESSION_ADOBE_DEFLATE;
+		if (!TIFFIsCODECConfigured(compression)) {
+			cerr << "DEFLATE unavailable in libtiff, writing LZW : " << filename << endl;
+			compression = COMPRESSION_LZW;
+		}
+
+		// without source georeferencing, at least record the sample spacing
+		geotags geo = ter.geo;
+		if (geo.pixelScale.empty()) {
+			geo.pixelScale = { ter.spacing / 110000, ter.spacing / 110000, 0 };
+		}
+
+		TIFF *tif = XTIFFOpen(filename.c_str(), "w");
+		if (tif == NULL) {
+			cerr << "Could not open file for writing : " << filename << endl;
+			throw runtime_error("Could not open file for writing");
+		}
+		setFloatTileFields(tif, cols, rows, tileSize, compression);
+		writeGeoTags(tif, geo);
+
+		// bound the memory held by encoded tiles to a few rows of tiles
+		const uint32 bandRows = std::max<uint32>(1, (4 * cv::getNumberOfCPUs() + tilesAcross - 1) / tilesAcross);
+		for (uint32 band = 0; band < tilesDown; band += bandRows) {
+			const uint32 bandEnd = std::min(tilesDown, band + bandRows);
+			const int count = int((bandEnd - band) * tilesAcross);
+			vector<vector<unsigned char>> encoded(count);
+
+			parallelFor(0, count, [&](int t) {
+				uint32 tx = (t % tilesAcross) * tileSize;
+				uint32 ty = (band + t / tilesAcross) * tileSize;
+				Rect r = Rect(tx, ty, tileSize, tileSize) & Rect(0, 0, cols, rows);
+
+				// edge tiles are padded out to the full tile size
+				Mat tile(tileSize, tileSize, CV_32FC1, Scalar(0));
+				ter.heightmap(r).copyTo(tile(Rect(0, 0, r.width, r.height)));
+				encoded[t] = encodeFloatTile(tile, tileSize, compression);
+			});
+
+			for (int t = 0; t < count; ++t) {
+				uint32 tx = (t % tilesAcross) * tileSize;
+				uint32 ty = (band + t / tilesAcross) * tileSize;
+				uint32 index = TIFFComputeTile(tif, tx, ty, 0, 0);
+				if (TIFFWriteRawTile(tif, index, encoded[t].data(), encoded[t].size()) < 0) {
+					TIFFClose(tif);
+					throw runtime_error("Failed to write TIFF tile.");
+				}
 			}
-			outfile << endl;
 		}
 
-		outfile.close();
+		TIFFClose(tif);
 	}
-}
\ No newline at end of file
+}
@@ -1,23 +1,64 @@
 #pragma once
 
 // std
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <vector>
 
 // opencv
 #include <opencv2/core.hpp>
 
 namespace zhou {
 
+	// GeoTIFF georeferencing carried through from a source raster
+	struct geotags {
+		std::vector<double> pixelScale; // ModelPixelScaleTag (sx, sy, sz)
+		std::vector<double> tiepoints; // ModelTiepointTag (i, j, k, x, y, z)*
+		std::vector<uint16_t> keyDirectory; // GeoKeyDirectoryTag
+		std::vector<double> doubleParams; // GeoDoubleParamsTag
+		std::string asciiParams; // GeoAsciiParamsTag
+	};
+
 	struct terrain {
 		cv::Mat heightmap; // raster elevation
 		double spacing; // real distance between adjacent samples
+		geotags geo; // empty unless read from a GeoTIFF
 		terrain() : heightmap{}, spacing{0} { }
 		terrain(cv::Mat _heightmap, double _spacing) : heightmap{ _heightmap }, spacing{ _spacing } {}
 	};
 
+	// Serves arbitrary rectangular windows of a stripped or tiled GeoTIFF on demand
+	// Uncompressed rasters are memory-mapped and each window is converted to float
+	// straight from the mapping, otherwise only the strips/tiles it touches are decoded
+	class terrainTIFFReader {
+	public:
+		explicit terrainTIFFReader(const std::string &filename);
+		~terrainTIFFReader();
+
+		terrainTIFFReader(const terrainTIFFReader &) = delete;
+		terrainTIFFReader & operator=(const terrainTIFFReader &) = delete;
+
+		cv::Size size() const;
+		double spacing() const;
+		const geotags & geo() const;
+		bool mapped() const; // true if windows are read zero-copy from a file mapping
+
+		// returns a CV_32FC1 window, samples outside the raster are NaN
+		// strips/tiles are decoded concurrently, each thread with its own handle
+		cv::Mat read(cv::Rect window) const;
+
+	private:
+		struct impl;
+		std::unique_ptr<impl> m_impl;
+	};
+
 	terrain terrainReadImage(const std::string &filename, double minVal, double maxVal, double spacing);
 	terrain terrainReadTIFF(const std::string &filename);
+	terrain terrainReadTIFF(const std::string &filename, cv::Rect window);
+	terrain terrainReadTxt(const std::string &filename);
 	void terrainWriteTxt(const std::string &filename, terrain ter);
+	void terrainWriteTIFF(const std::string &filename, terrain ter);
 
 	cv::Mat heightmapToImage(cv::Mat heightmap);
 	cv::Mat heightmapToImage(cv::Mat heightmap, double minv, double maxv);
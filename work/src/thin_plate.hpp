@@ -1,6 +1,7 @@
 #pragma once
 
 // std
+#include <memory>
 #include <vector>
 
 // eigen
@@ -13,19 +14,24 @@
 
 namespace zhou {
 
-	template<typename T>
+	// Allocator is used for the samples and weights (the system of equations is
+	// kept on the stack for up to inlineSamples samples)
+	template<typename T, typename Allocator = std::allocator<T>>
 	class thinplate2d {
 	public:
 		using VecT = cv::Vec<T, 2>;
+		static const int inlineSamples = 13;
 
 	private:
+		using VecAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<VecT>;
+
 		// data
-		std::vector<VecT> m_samples;
-		std::vector<VecT> m_values;
+		std::vector<VecT, VecAllocator> m_samples;
+		std::vector<VecT, VecAllocator> m_values;
 
 		// weights
-		std::vector<T> m_weights0;
-		std::vector<T> m_weights1;
+		std::vector<T, Allocator> m_weights0;
+		std::vector<T, Allocator> m_weights1;
 		cv::Vec<T, 3> m_a0;
 		cv::Vec<T, 3> m_a1;
 
@@ -39,26 +45,19 @@ namespace zhou {
 			return (r != r) ? T(0) : r;
 		}
 
-	public:
-		thinplate2d() { }
-
-		void addPoint(const VecT &sample, const VecT &value) {
-			m_samples.push_back(sample);
-			m_values.push_back(value);
-		}
-
-		void computeWeights() {
-			assert(m_samples.size() == m_values.size());
-			assert(m_samples.size() >= 3);
-
+		// MaxSize bounds the size of the system, Eigen::Dynamic for any size
+		template <int MaxSize>
+		void solveWeights() {
 			using namespace std;
 
+			typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, 0, MaxSize, MaxSize> MatrixT;
+			typedef Eigen::Matrix<T, Eigen::Dynamic, 1, 0, MaxSize, 1> VectorT;
+
 			// L = [ K    S ]   X = [ W ]   Y = [ V ]
 			//     [ S^t  0 ],      [ A ],      [ 0 ]
-			Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> L(m_samples.size() + 3, m_samples.size() + 3);
-			Eigen::Matrix<T, Eigen::Dynamic, 1> x(m_samples.size() + 3);
-			Eigen::Matrix<T, Eigen::Dynamic, 1> Y0(m_samples.size() + 3);
-			Eigen::Matrix<T, Eigen::Dynamic, 1> Y1(m_samples.size() + 3);
+			MatrixT L(m_samples.size() + 3, m_samples.size() + 3);
+			VectorT Y0(m_samples.size() + 3);
+			VectorT Y1(m_samples.size() + 3);
 
 			// build L and Y
 			// zero out L and Y
@@ -101,9 +100,9 @@ namespace zhou {
 
 			// solve for X
 			// Useing LU decomposition because L is symmetric
-			Eigen::PartialPivLU<Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>> solver(L);
-			Eigen::Matrix<T, Eigen::Dynamic, 1> X0 = solver.solve(Y0);
-			Eigen::Matrix<T, Eigen::Dynamic, 1> X1 = solver.solve(Y1);
+			Eigen::PartialPivLU<MatrixT> solver(L);
+			VectorT X0 = solver.solve(Y0);
+			VectorT X1 = solver.solve(Y1);
 
 			// W = [ w0 ]
 			//     [ w1 ]
@@ -125,9 +124,9 @@ namespace zhou {
 			m_a1 = cv::Vec<T, 3>(X1(m_samples.size() + 0), X1(m_samples.size() + 1), X1(m_samples.size() + 2));
 
 			// caculate the energy I = W^t K W
-			Eigen::Matrix<T, Eigen::Dynamic, 1> W0(X0.block(0, 0, m_samples.size(), 1));
-			Eigen::Matrix<T, Eigen::Dynamic, 1> W1(X1.block(0, 0, m_samples.size(), 1));
-			Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> K(L.block(0, 0, m_samples.size(), m_samples.size()));
+			VectorT W0(X0.block(0, 0, m_samples.size(), 1));
+			VectorT W1(X1.block(0, 0, m_samples.size(), 1));
+			MatrixT K(L.block(0, 0, m_samples.size(), m_samples.size()));
 			m_energy = W0.transpose() * K * W0;
 			m_energy += W1.transpose() * K * W1;
 
@@ -139,6 +138,26 @@ namespace zhou {
 			 //std::cout << "m_energy" << m_energy << std::endl << std::endl;
 		}
 
+	public:
+		thinplate2d() { }
+
+		void addPoint(const VecT &sample, const VecT &value) {
+			m_samples.push_back(sample);
+			m_values.push_back(value);
+		}
+
+		void computeWeights() {
+			assert(m_samples.size() == m_values.size());
+			assert(m_samples.size() >= 3);
+
+			if (m_samples.size() <= inlineSamples) {
+				solveWeights<inlineSamples + 3>();
+			}
+			else {
+				solveWeights<Eigen::Dynamic>();
+			}
+		}
+
 
 		VecT evaluate(const VecT &p) const {
 			VecT result(m_a0[0] + m_a0[1]*p[0] + m_a0[2]*p[1], m_a1[0] + m_a1[1] * p[0] + m_a1[2] * p[1]);
@@ -154,11 +173,11 @@ namespace zhou {
 
 
 		std::vector<VecT> samples() const {
-			return m_samples;
+			return std::vector<VecT>(m_samples.begin(), m_samples.end());
 		}
 		
 		std::vector<VecT> values() const {
-			return m_values;
+			return std::vector<VecT>(m_values.begin(), m_values.end());
 		}
 	};
 
@@ -1,6 +1,8 @@
 #pragma once
 
 // std
+#include <functional>
+#include <memory>
 #include <vector>
 #include <queue>
 
@@ -14,6 +16,17 @@
 #include "graphcut.hpp"
 #include "terrain.hpp"
 #include "patchmerge.hpp"
+#include "profile.hpp"
+#include "coverage.hpp"
+#include "patchbank.hpp"
+#include "rotationbank.hpp"
+#include "kernels.hpp"
+#include "arena.hpp"
+#include "parallel.hpp"
+#include "speculative.hpp"
+#include "checkpoint.hpp"
+#include "taskgraph.hpp"
+#include "provenance.hpp"
 
 namespace zhou {
 
@@ -23,7 +36,7 @@ namespace zhou {
 		int patchsize = 80;
 
 		//ppa
-		static enum {
+		enum {
 			PPA_RIDGE_FEATURES,
 			PPA_VALLEY_FEATURES,
 			PPA_RIDGE_AND_VALLEY_FEATURES
@@ -37,44 +50,121 @@ namespace zhou {
 		float featureGraphcutWeight = 1;
 		float featureProfileWeight = 30;
 		float featureProfileCount = 7;
+		int featureRotations = 0; // angles in the example rotation bank (0 resamples every rotated candidate)
+		bool featureRotationRefine = true; // recompute the best bank candidate exactly
+		int featureBatchSize = 16; // targets placed concurrently (1 places them strictly in order)
+		int featureLookahead = 16; // upcoming targets searched while a batch is placed (0 disables)
 
 		// non-feature patch
 		int k_set = 3;
 		int nonfeatureSpacing = 100;
 		float nonfeatureOverlapWeight = 1;
 		float nonfeatureGraphcutWeight = 1;
+		int nonfeatureBankLevels = 3; // resolutions kept for candidate pruning (1 is full only)
+		int nonfeatureBankPrecision = HEIGHT_FLOAT32; // HEIGHT_FLOAT32, HEIGHT_FLOAT16 or HEIGHT_INT16
+		int nonfeatureBatchSize = 16; // targets placed concurrently (1 places them strictly in order)
+		int nonfeatureLookahead = 16; // upcoming targets searched while a batch is placed (0 disables)
 
 		// alternative patch-patch algorithm
-		static enum {
+		enum {
 			PATHPATCH_TPS,
 			PATHPATCH_CORNER_TPS,
 			PATHPATCH_ROTATE
 		};
 		int pathPatchAlgorithm = PATHPATCH_ROTATE;
 
+		// seam removal (POISSON_LEAST_SQUARES, POISSON_MULTIGRID, POISSON_CHOLESKY or POISSON_DST)
+		int seamSolver = POISSON_LEAST_SQUARES;
+
+		// checkpoints (an empty path disables them)
+		std::string checkpointPath;
+		double checkpointInterval = 300; // seconds between checkpoints
+
+		// polled between batches, when it returns true the run stops, writes a
+		// final checkpoint and returns the partial synthesis
+		std::function<bool()> interrupt;
+
 	};
 
 	struct featurePatchCandidate{
-		fpatch fp;
+		const fpatch *fp = nullptr; // into the feature patches searched, which must outlive the candidate
 		float weight;
 		cv::Mat patch;
 		cv::Mat graphcut;
+		bool approximate = false; // patch looked up in the rotation bank
+		float angle = 0; // rotation of the lookup
+		cv::Mat coords; // CV_32FC2, example coordinates of each pixel of the patch (see findFeaturePatch)
 	};
 
 	struct nonfeaturePatchCandidate {
 		float weight;
 		cv::Mat patch;
 		cv::Mat graphcut;
+		int source = -1; // index of the patch in the bank
+		int example = 0; // index of the example the bank is of (see examplelibrary)
 	};
 
+	// copies a candidate out of the scratchscope it was created in
+	inline featurePatchCandidate detach(const featurePatchCandidate &cand) {
+		featurePatchCandidate copy = cand;
+		copy.patch = cand.patch.clone();
+		copy.graphcut = cand.graphcut.clone();
+		copy.coords = cand.coords.clone();
+		return copy;
+	}
+
+	inline nonfeaturePatchCandidate detach(const nonfeaturePatchCandidate &cand) {
+		nonfeaturePatchCandidate copy = cand;
+		copy.patch = cand.patch.clone();
+		copy.graphcut = cand.graphcut.clone();
+		return copy;
+	}
+
 	struct nonfeaturePatchTarget {
-		int overlappingPixels;
+		int overlappingPixels; // number of pixels still to be synthesized
 		cv::Vec2i position; // topleft
-		cv::Mat patch;
+		cv::Mat patch; // only extracted when the target is synthesized
+		bool done = false;
 	};
 
 
-	featurePatchCandidate createFeaturePatchCandidate(const cv::Mat examplemap, const cv::Mat synthesis, fpatch candidate, fpatch target, synthesisparams params) {
+	// offset from the target center of the p'th sample of the ridge profile
+	// across the n'th outpath
+	inline cv::Vec2f featureProfileOffset(const fpatch &target, int n, int p, int profilePoints) {
+		using namespace cv;
+		Vec2f perpendicular = normalize(Vec2f(target.controlpoints[n][1], -target.controlpoints[n][0])) * 5;
+		float distance = p - float(profilePoints) / 2;
+		return target.controlpoints[n] + distance * perpendicular;
+	}
+
+
+	// every pixel of the synthesis that evaluating or placing a patch at the
+	// target can read or write: the patch area, the ridge profile samples (plus
+	// one for bilinear interpolation) and the one pixel ring used to remove seams
+	inline cv::Rect featureTargetFootprint(const fpatch &target, synthesisparams params) {
+		using namespace cv;
+		using namespace std;
+
+		int hs1 = params.patchsize / 2;
+		// the placement position is truncated and the graphcut position rounded
+		Rect footprint(cvFloor(target.center[0]) - hs1, cvFloor(target.center[1]) - hs1, params.patchsize + 1, params.patchsize + 1);
+		const int profilePoints = params.featureProfileCount;
+		for (int n = 0; n < int(target.controlpoints.size()); ++n) {
+			for (int p = 0; p < profilePoints; ++p) {
+				Vec2f q = target.center + featureProfileOffset(target, n, p, profilePoints);
+				footprint |= Rect(cvFloor(q[0]), cvFloor(q[1]), 2, 2);
+			}
+		}
+		return Rect(footprint.x - 1, footprint.y - 1, footprint.width + 2, footprint.height + 2);
+	}
+
+
+	// rotated candidates are looked up in rotations if it isn't null or empty
+	// (without coords, see lookupCoords)
+	// the temporaries, patch, graphcut and coords are scratchMats (see arena.hpp)
+	// a candidate whose cost is already above bound before the graphcut is
+	// given an infinite weight without computing the cut
+	featurePatchCandidate createFeaturePatchCandidate(const cv::Mat examplemap, const cv::Mat synthesis, const fpatch &candidate, const fpatch &target, synthesisparams params, const rotationbank *rotations = nullptr, float bound = std::numeric_limits<float>::infinity()) {
 		assert(!examplemap.empty());
 		assert(!synthesis.empty());
 		assert(examplemap.type() == CV_32FC1);
@@ -83,6 +173,8 @@ namespace zhou {
 		using namespace cv;
 		using namespace std;
 
+		profile::scope prof("feature.candidate");
+
 		int hs1 = params.patchsize / 2;
 		int hs2 = params.patchsize - hs1;
 		Vec2f patchCenter(hs1, hs1);
@@ -90,18 +182,19 @@ namespace zhou {
 		float cost = 0;
 
 		featurePatchCandidate cand;
+		cand.fp = &candidate;
+		cand.patch = scratchMat();
+
+		// rotation from the candidate to the target (if the patch is only rotated)
+		bool rotated = false;
+		float angle = 0;
 
 		// sample patch
 		//
-		Mat patchCoords(params.patchsize, params.patchsize, CV_32FC2);
-		// if the degree doesn't match, just copy the patch directly
+		Mat patchCoords = scratchMat();
+		// if the degree doesn't match, just copy the patch directly (no rotation)
 		if (candidate.controlpoints.size() != target.controlpoints.size()) {
-			for (int i = 0; i < params.patchsize; ++i) {
-				for (int j = 0; j < params.patchsize; ++j) {
-					Vec2f p = Vec2f(j, i) - patchCenter + candidate.center;
-					patchCoords.at<Vec2f>(i, j) = p;
-				}
-			}
+			rotated = true;
 		}
 		// if the degree is 1, use rotation
 		else if (candidate.controlpoints.size() == 1) {
@@ -110,19 +203,8 @@ namespace zhou {
 
 			// calculate the rotation from candidate to the target
 			float sign = copysign(1, targetAlign[0] * candidateAlign[1] - targetAlign[1] * candidateAlign[0]);
-			float angle = sign * acos(targetAlign.dot(candidateAlign));
-			float c = cos(angle);
-			float s = sin(angle);
-
-			// apply the rotation
-			for (int i = 0; i < params.patchsize; ++i) {
-				for (int j = 0; j < params.patchsize; ++j) {
-					Vec2f p = Vec2f(j, i) - patchCenter;
-					p = Vec2f(c * p[0] - s * p[1], s * p[0] + c * p[1]);
-					p += candidate.center;
-					patchCoords.at<Vec2f>(i, j) = p;
-				}
-			}
+			angle = sign * acos(targetAlign.dot(candidateAlign));
+			rotated = true;
 		}
 		// otherwise degrees are the same, use thin-plate splines
 		else {
@@ -147,26 +229,16 @@ namespace zhou {
 
 				// calculate the rotation from candidate to the target
 				float sign = copysign(1, targetAlign[0] * candidateAlign[1] - targetAlign[1] * candidateAlign[0]);
-				float angle = sign * acos(targetAlign.dot(candidateAlign));
-				float c = cos(angle);
-				float s = sin(angle);
-
-				// apply the rotation
-				for (int i = 0; i < params.patchsize; ++i) {
-					for (int j = 0; j < params.patchsize; ++j) {
-						Vec2f p = Vec2f(j, i) - patchCenter;
-						p = Vec2f(c * p[0] - s * p[1], s * p[0] + c * p[1]);
-						p += candidate.center;
-						patchCoords.at<Vec2f>(i, j) = p;
-					}
-				}
+				angle = sign * acos(targetAlign.dot(candidateAlign));
+				rotated = true;
 			}
 			else {
 				// COST of spline
 				//
-				thinplate2d<float> bestspline;
+				thinplate2d<float, scratchallocator<float>> bestspline;
+				patchCoords.create(params.patchsize, params.patchsize, CV_32FC2);
 				for (int offset = 0; offset < target.controlpoints.size(); offset++) {
-					thinplate2d<float> spline;
+					thinplate2d<float, scratchallocator<float>> spline;
 					spline.addPoint(target.center, candidate.center); // center
 					for (int n = 0; n < target.controlpoints.size(); ++n) { // outpaths
 						int idx = (n + offset) % target.controlpoints.size();
@@ -202,67 +274,100 @@ namespace zhou {
 		}
 
 		// create patch (making sure we don't use patches off the example)
-		remap(examplemap, cand.patch, patchCoords, Mat(), INTER_LINEAR, BORDER_CONSTANT, Scalar(numeric_limits<float>::quiet_NaN()));
-		if (isnan(sum(cand.patch)[0])) {
-			cand.weight = numeric_limits<float>::infinity();
-			return cand;
+		// a rotated (or copied) patch is rejected before sampling if it runs off
+		// the example, and only checked after sampling if it is too close to tell
+		int feasibility = PATCH_FEASIBILITY_UNKNOWN;
+		if (rotated) {
+			feasibility = rotatedPatchFeasibility(candidate, angle, params.patchsize, examplemap.size());
+			if (feasibility == PATCH_INFEASIBLE) {
+				profile::counter("feature.infeasible", 1);
+				profile::counter("feature.infeasible.analytic", 1);
+				cand.weight = numeric_limits<float>::infinity();
+				return cand;
+			}
+		}
+		if (rotated && rotations && !rotations->empty()) {
+			profile::scope prof_lookup("feature.rotationbank");
+			if (!rotations->lookup(angle, candidate.center, params.patchsize, cand.patch)) {
+				profile::counter("feature.infeasible", 1);
+				cand.weight = numeric_limits<float>::infinity();
+				return cand;
+			}
+			cand.approximate = true;
+			cand.angle = angle;
+		}
+		else {
+			if (rotated) {
+				// apply the rotation
+				float c = cos(angle);
+				float s = sin(angle);
+				patchCoords.create(params.patchsize, params.patchsize, CV_32FC2);
+				for (int i = 0; i < params.patchsize; ++i) {
+					for (int j = 0; j < params.patchsize; ++j) {
+						Vec2f p = Vec2f(j, i) - patchCenter;
+						p = Vec2f(c * p[0] - s * p[1], s * p[0] + c * p[1]);
+						p += candidate.center;
+						patchCoords.at<Vec2f>(i, j) = p;
+					}
+				}
+			}
+
+			profile::scope prof_remap("feature.remap");
+			if (feasibility != PATCH_FEASIBLE) {
+				remap(examplemap, cand.patch, patchCoords, Mat(), INTER_LINEAR, BORDER_CONSTANT, Scalar(numeric_limits<float>::quiet_NaN()));
+				if (kernels::nanCount(cand.patch.ptr<float>(), cand.patch.total()) > 0) {
+					profile::counter("feature.infeasible", 1);
+					cand.weight = numeric_limits<float>::infinity();
+					return cand;
+				}
+			}
+			remap(examplemap, cand.patch, patchCoords, Mat(), INTER_LINEAR, BORDER_REPLICATE);
+			cand.coords = patchCoords;
 		}
-		remap(examplemap, cand.patch, patchCoords, Mat(), INTER_LINEAR, BORDER_REPLICATE);
 
 		
 		// COST of ridge profile 
 		//
 		if (candidate.controlpoints.size() == target.controlpoints.size() && !target.controlpoints.empty()) {
+			profile::scope prof_profile("feature.profile");
 			float ridgeSSD = 0;
 			const int controlPoints = target.controlpoints.size();
 			const int profilePoints = params.featureProfileCount;
 
-			Mat targetCoords(controlPoints, profilePoints, CV_32FC2);
-			Mat patchCoords(controlPoints, profilePoints, CV_32FC2);
+			Mat targetCoords = scratchMat(controlPoints, profilePoints, CV_32FC2);
+			Mat patchCoords = scratchMat(controlPoints, profilePoints, CV_32FC2);
 
 			// for each outpatch (control point)
 			for (int n = 0; n < controlPoints; ++n) {
-
-				Vec2f targetOutpath = target.center + target.controlpoints[n];
-				Vec2f patchOutpath = patchCenter + target.controlpoints[n];
-				Vec2f perpendicular = normalize(Vec2f(target.controlpoints[n][1], -target.controlpoints[n][0])) * 5;
-
-				//cout << "targetCenter: " << targetCenter << endl;
-				//cout << "targetOutpath: " << targetOutpath << endl;
-				//cout << "patchCenter: " << patchCenter << endl;
-				//cout << "patchOutpath: " << patchOutpath << endl;
-				//cout << "perpendicular: " << targetCenter << endl;
-
 				// sample perpendicular line across the outpath of the synthesis and the patch
 				for (int p = 0; p < profilePoints; ++p) {
-					float distance = p - float(profilePoints) / 2;
-					targetCoords.at<Vec2f>(n, p) = distance * perpendicular + targetOutpath;
-					patchCoords.at<Vec2f>(n, p) = distance * perpendicular + patchOutpath;
+					Vec2f offset = featureProfileOffset(target, n, p, profilePoints);
+					targetCoords.at<Vec2f>(n, p) = target.center + offset;
+					patchCoords.at<Vec2f>(n, p) = patchCenter + offset;
 				}
 			}
 
 			// remap and don't consider nan values
-			Mat targetRidge, patchRidge;
+			Mat targetRidge = scratchMat(), patchRidge = scratchMat();
 			remap(synthesis, targetRidge, targetCoords, Mat(), CV_INTER_LINEAR, BORDER_CONSTANT, Scalar(numeric_limits<float>::quiet_NaN()));
 			remap(cand.patch, patchRidge, patchCoords, Mat(), CV_INTER_LINEAR, BORDER_CONSTANT, Scalar(numeric_limits<float>::quiet_NaN()));
 
 			// ridge difference
-			for (int n = 0; n < controlPoints; ++n) {
-				for (int p = 0; p < profilePoints; ++p) {
-					float d = targetRidge.at<float>(n, p) - patchRidge.at<float>(n, p);
-					if (!isnan(d)) {
-						ridgeSSD += d * d;
-					}
-				}
-			}
+			ridgeSSD = kernels::maskedSSD(targetRidge.ptr<float>(), patchRidge.ptr<float>(), targetRidge.total());
 
 			cost += ridgeSSD * params.featureProfileWeight;
 		}
 
 
 		// COST of graphcut
+		// (never negative, so it can't bring a candidate back under the bound)
 		//
-		float graphcut_cost;
+		if (cost > bound && params.featureGraphcutWeight >= 0) {
+			profile::counter("feature.pruned", 1);
+			cand.weight = numeric_limits<float>::infinity();
+			return cand;
+		}
+		float graphcut_cost = 0;
 		cand.graphcut = zhou::graphcut(synthesis, cand.patch, Vec2i(target.center - patchCenter), &graphcut_cost);
 		cost += graphcut_cost * params.featureGraphcutWeight;
 
@@ -274,7 +379,79 @@ namespace zhou {
 
 
 
-	inline nonfeaturePatchCandidate createNonfeaturePatchCandidate(cv::Mat candidate, cv::Mat target, synthesisparams params) {
+	// finds the best of the feature patches whose degree matches the target (or,
+	// with sameDegree false, doesn't)
+	// each candidate is evaluated in scratch memory, only the best so far is
+	// copied out of it
+	// with a bound shared by several searches, each one skips the graphcut of
+	// candidates already worse than the best found by any of them, and lowers
+	// the bound as it finds better ones (a candidate equal to the bound is still
+	// evaluated, so the combined best doesn't depend on the timing)
+	// the example coordinates of the best are only kept if coords is set
+	inline featurePatchCandidate searchFeaturePatches(const cv::Mat examplemap, const cv::Mat synthesis, const std::vector<fpatch> &featurepatches, const fpatch &target, synthesisparams params, const rotationbank *rotations, bool sameDegree, std::atomic<float> *bound = nullptr, bool coords = false) {
+		using namespace cv;
+		using namespace std;
+
+		int evaluated = 0;
+
+		featurePatchCandidate best;
+		best.weight = numeric_limits<float>::infinity();
+		for (const fpatch &candidate : featurepatches) {
+			if ((candidate.controlpoints.size() == target.controlpoints.size()) != sameDegree) continue;
+
+			scratchscope scratch;
+			float limit = bound ? min(best.weight, bound->load()) : best.weight;
+			featurePatchCandidate cand = createFeaturePatchCandidate(examplemap, synthesis, candidate, target, params, rotations, limit);
+			evaluated++;
+			if (cand.weight < best.weight) {
+				if (!coords) cand.coords = Mat();
+				best = detach(cand);
+				if (bound) atomicMin(*bound, best.weight);
+			}
+		}
+
+		profile::counter("feature.candidates", evaluated);
+		return best;
+	}
+
+
+	// example coordinates of a candidate looked up in the rotation bank, only
+	// made for the candidate that is placed
+	inline void lookupCoords(featurePatchCandidate &cand, const rotationbank &rotations, int patchsize) {
+		if (cand.approximate) {
+			cand.coords = rotations.coordinates(cand.angle, cand.fp->center, patchsize);
+		}
+	}
+
+
+	// finds the best feature patch for the target, falling back to patches of a
+	// different degree if none of the same degree can be placed
+	// with a rotation bank the best candidate can be refined by resampling it exactly
+	// the candidate has the example coordinates of the patch only if coords is set
+	inline featurePatchCandidate findFeaturePatch(const cv::Mat examplemap, const cv::Mat synthesis, const std::vector<fpatch> &featurepatches, const fpatch &target, synthesisparams params, const rotationbank *rotations = nullptr, bool coords = false) {
+		using namespace cv;
+		using namespace std;
+
+		featurePatchCandidate best = searchFeaturePatches(examplemap, synthesis, featurepatches, target, params, rotations, true, nullptr, coords);
+
+		// if we didn't find a matching candidate, use a non-matching candidate
+		if (isinf(best.weight)) {
+			best = searchFeaturePatches(examplemap, synthesis, featurepatches, target, params, rotations, false, nullptr, coords);
+		}
+
+		// (keeping the lookup if the exact patch runs off the example)
+		if (best.approximate && params.featureRotationRefine) {
+			featurePatchCandidate exact = createFeaturePatchCandidate(examplemap, synthesis, *best.fp, target, params);
+			if (!isinf(exact.weight)) best = exact;
+		}
+		if (coords && rotations) lookupCoords(best, *rotations, params.patchsize);
+		return best;
+	}
+
+
+
+	// ssd is the sum of squared differences over the known (non-NaN) target values
+	inline nonfeaturePatchCandidate createNonfeaturePatchCandidate(cv::Mat candidate, cv::Mat target, float ssd, synthesisparams params) {
 		assert(!candidate.empty());
 		assert(!target.empty());
 		assert(candidate.type() == CV_32FC1);
@@ -284,28 +461,21 @@ namespace zhou {
 		using namespace cv;
 		using namespace std;
 
+		profile::scope prof("nonfeature.candidate");
+
 		nonfeaturePatchCandidate cand;
 		cand.patch = candidate;
 		float cost = 0;
 
 		// COST of graphcut
-		//
-		float graphcut_cost;
+		// (zero if there is no cut to make)
+		float graphcut_cost = 0;
 		cand.graphcut = zhou::graphcut(target, cand.patch, Vec2i(0, 0), &graphcut_cost);
-		cost += graphcut_cost * params.featureGraphcutWeight;
+		cost += graphcut_cost * params.nonfeatureGraphcutWeight;
 
 
 		// COST of SSD
 		//
-		float ssd = 0;
-		for (int i = 0; i < params.patchsize; ++i) {
-			for (int j = 0; j < params.patchsize; ++j) {
-				float d = candidate.at<float>(i, j) - target.at<float>(i, j);
-				if (!isnan(d)) {
-					ssd += d * d;
-				}
-			}
-		}
 		cost += ssd * params.nonfeatureOverlapWeight;
 
 
@@ -315,138 +485,729 @@ namespace zhou {
 	}
 
 
+	inline nonfeaturePatchCandidate createNonfeaturePatchCandidate(cv::Mat candidate, cv::Mat target, synthesisparams params) {
+		assert(candidate.size() == target.size());
+
+		using namespace cv;
+		using namespace std;
+
+		profile::scope prof_ssd("nonfeature.ssd");
+		float ssd = 0;
+		for (int i = 0; i < candidate.rows; ++i) {
+			ssd += kernels::maskedSSD(candidate.ptr<float>(i), target.ptr<float>(i), candidate.cols);
+		}
+		prof_ssd.end();
 
+		return createNonfeaturePatchCandidate(candidate, target, ssd, params);
+	}
 
-	inline cv::Mat synthesize(const cv::Mat examplemap, const cv::Mat sketchmap, synthesisparams params) {
-		assert(examplemap.type() == CV_32FC1);
+
+
+
+	// finds the best candidate in the bank for the target (NaN where unsynthesized)
+	// the graphcut cost is never negative, so a candidate whose SSD cost (or a
+	// lower bound of it) is already worse than the best is skipped without
+	// computing the cut
+	// each cut is made in scratch memory, only the best so far is copied out of it
+	// a bound shared by several searches prunes with the best found by any of
+	// them, as for searchFeaturePatches
+	inline nonfeaturePatchCandidate findNonfeaturePatch(const patchbank &bank, cv::Mat target, synthesisparams params, std::atomic<float> *bound = nullptr) {
+		using namespace cv;
+		using namespace std;
+
+		patchbank::query query = bank.prepare(target);
+		nonfeaturePatchCandidate best;
+		best.weight = numeric_limits<float>::infinity();
+		auto pruned = [&](float cost) {
+			return cost >= best.weight || (bound && cost > bound->load());
+		};
+		int evaluated = 0;
+		for (int p = 0; p < bank.count(); ++p) {
+			if (pruned(bank.normBound(query, p) * params.nonfeatureOverlapWeight)) continue;
+			bool skip = false;
+			for (int l = bank.levels() - 1; l > 0 && !skip; --l) {
+				skip = pruned(bank.ssd(query, p, l) * params.nonfeatureOverlapWeight);
+			}
+			if (skip) continue;
+
+			float ssd = bank.ssd(query, p);
+			if (pruned(ssd * params.nonfeatureOverlapWeight)) continue;
+
+			scratchscope scratch;
+			nonfeaturePatchCandidate cand = createNonfeaturePatchCandidate(bank.patch(p), target, ssd, params);
+			cand.source = p;
+			evaluated++;
+			if (cand.weight < best.weight) {
+				best = detach(cand);
+				if (bound) atomicMin(*bound, best.weight);
+			}
+		}
+
+		profile::counter("nonfeature.candidates", evaluated);
+		return best;
+	}
+
+
+
+
+	// Examples to synthesize from
+	//
+	// The analysis of each example (its feature patches, tagged with the index
+	// of the example, its rotation bank and its bank of non-feature patches) is
+	// made once and kept for every synthesis from the library, for as long as
+	// the analysis parameters stay the same. Examples are analysed in parallel.
+	//
+	// The candidate search for a target runs over the examples in parallel and
+	// takes the best candidate of all of them, ties going to the example added
+	// first. The searches share the best cost found so far, so an example that
+	// can't beat it is mostly pruned rather than fully evaluated.
+	class examplelibrary {
+	public:
+		struct example {
+			std::string name;
+			cv::Mat map; // CV_32FC1
+			bool analyzed = false;
+
+			std::vector<fpatch> featurepatches;
+			rotationbank rotations; // empty unless featureRotations > 0
+			std::vector<cv::Point> nonfeatureOrigins; // where each bank patch was taken from
+			patchbank bank; // empty if there are no non-feature patches
+		};
+
+	private:
+		std::vector<example> m_examples;
+		synthesisparams m_analysis; // parameters of the analysis made so far
+
+		static bool sameAnalysis(const synthesisparams &a, const synthesisparams &b) {
+			return a.patchsize == b.patchsize
+				&& a.ppaGridSpacing == b.ppaGridSpacing
+				&& a.profile_length == b.profile_length
+				&& a.featureRotations == b.featureRotations
+				&& a.nonfeatureBankLevels == b.nonfeatureBankLevels
+				&& a.nonfeatureBankPrecision == b.nonfeatureBankPrecision;
+		}
+
+	public:
+		examplelibrary() { }
+
+		// returns the index of the example
+		int add(const cv::Mat map, const std::string &name = std::string()) {
+			assert(map.type() == CV_32FC1);
+			example e;
+			e.name = name;
+			e.map = map;
+			m_examples.push_back(std::move(e));
+			return int(m_examples.size()) - 1;
+		}
+
+		int size() const { return int(m_examples.size()); }
+		bool empty() const { return m_examples.empty(); }
+		const example & operator[](int k) const { return m_examples[k]; }
+
+		bool analyzed(const synthesisparams &params) const {
+			if (!sameAnalysis(params, m_analysis)) return false;
+			for (const example &e : m_examples) {
+				if (!e.analyzed) return false;
+			}
+			return true;
+		}
+
+		std::vector<cv::Size> sizes() const {
+			std::vector<cv::Size> s;
+			for (const example &e : m_examples) s.push_back(e.map.size());
+			return s;
+		}
+
+		// every feature patch of the library
+		std::vector<fpatch> featurepatches() const {
+			std::vector<fpatch> patches;
+			for (const example &e : m_examples) patches.insert(patches.end(), e.featurepatches.begin(), e.featurepatches.end());
+			return patches;
+		}
+
+		bool hasNonfeaturePatches() const {
+			for (const example &e : m_examples) {
+				if (e.bank.count() > 0) return true;
+			}
+			return false;
+		}
+
+		// adds the analysis of every example that isn't analysed for params to
+		// tasks, the library must not change until the tasks have run
+		// the feature patches of examples in known (by their example index) are
+		// used instead of analysing those examples again
+		void addAnalysis(taskgraph &tasks, const synthesisparams &params, const std::vector<fpatch> *known = nullptr) {
+			using namespace cv;
+			using namespace std;
+
+			if (!sameAnalysis(params, m_analysis)) {
+				for (example &e : m_examples) e.analyzed = false;
+				m_analysis = params;
+			}
+
+			for (int k = 0; k < size(); ++k) {
+				example *e = &m_examples[k];
+				if (e->analyzed) continue;
+
+				// 1) Identify features and 2) extract feature patches
+				// TODO for ridge and valley seperately
+				int patches;
+				if (known) {
+					patches = tasks.add("library.extract", [e, k, known] {
+						e->featurepatches.clear();
+						for (const fpatch &fp : *known) {
+							if (fp.example == k) e->featurepatches.push_back(fp);
+						}
+						computeSafeRadius(e->featurepatches, e->map.size());
+					});
+				}
+				else {
+					shared_ptr<unique_ptr<ppa::FeatureGraph>> features = make_shared<unique_ptr<ppa::FeatureGraph>>();
+					int ppa = tasks.add("library.ppa", [e, features, params] {
+						features->reset(new ppa::FeatureGraph(e->map, params.ppaGridSpacing, params.profile_length));
+					});
+					patches = tasks.add("library.extract", [e, k, features, params] {
+						e->featurepatches = extractFeaturePatches(**features, params.patchsize);
+						features->reset();
+						for (fpatch &fp : e->featurepatches) fp.example = k;
+						computeSafeRadius(e->featurepatches, e->map.size());
+					}, { ppa });
+				}
+				vector<int> steps = { patches };
+
+				// rotated candidates become lookups into the example resampled at fixed angles
+				e->rotations = rotationbank();
+				if (params.featureRotations > 0) {
+					steps.push_back(tasks.add("library.rotations", [e, params] {
+						e->rotations = rotationbank(e->map, params.featureRotations);
+					}));
+				}
+
+				// the non-feature patches only depend on where the feature patches are
+				steps.push_back(tasks.add("library.nonfeature", [e, params] {
+					vector<Mat> nonfeaturePatches = extractNonfeaturePatches(e->map, e->featurepatches, params.patchsize, &e->nonfeatureOrigins);
+					e->bank = nonfeaturePatches.empty() ? patchbank() : patchbank(nonfeaturePatches, params.nonfeatureBankLevels, params.nonfeatureBankPrecision);
+				}, { patches }));
+
+				tasks.add("library.analyzed", [e] {
+					e->analyzed = true;
+				}, steps);
+			}
+		}
+
+		void analyze(const synthesisparams &params) {
+			profile::scope prof("library.analyze");
+			taskgraph tasks;
+			addAnalysis(tasks, params);
+			tasks.run();
+		}
+	};
+
+
+	// finds the best feature patch for the target in any example of the library
+	// as findFeaturePatch, with the examples searched in parallel
+	inline featurePatchCandidate findFeaturePatch(const examplelibrary &library, const cv::Mat synthesis, const fpatch &target, synthesisparams params, bool coords = false) {
+		using namespace cv;
+		using namespace std;
+
+		auto search = [&](bool sameDegree) {
+			atomic<float> bound(numeric_limits<float>::infinity());
+			vector<featurePatchCandidate> shards(library.size());
+			parallelFor(0, library.size(), [&](int k) {
+				const examplelibrary::example &e = library[k];
+				shards[k] = searchFeaturePatches(e.map, synthesis, e.featurepatches, target, params, &e.rotations, sameDegree, &bound, coords);
+			});
+
+			featurePatchCandidate best;
+			best.weight = numeric_limits<float>::infinity();
+			for (featurePatchCandidate &cand : shards) {
+				if (cand.weight < best.weight) best = move(cand);
+			}
+			return best;
+		};
+
+		featurePatchCandidate best = search(true);
+
+		// if we didn't find a matching candidate, use a non-matching candidate
+		if (isinf(best.weight)) {
+			best = search(false);
+		}
+
+		// (keeping the lookup if the exact patch runs off the example)
+		if (best.approximate && params.featureRotationRefine) {
+			featurePatchCandidate exact = createFeaturePatchCandidate(library[best.fp->example].map, synthesis, *best.fp, target, params);
+			if (!isinf(exact.weight)) best = exact;
+		}
+		if (coords && best.fp) lookupCoords(best, library[best.fp->example].rotations, params.patchsize);
+		return best;
+	}
+
+
+	// finds the best non-feature patch for the target in any example of the
+	// library, with the examples searched in parallel
+	inline nonfeaturePatchCandidate findNonfeaturePatch(const examplelibrary &library, cv::Mat target, synthesisparams params) {
+		using namespace cv;
+		using namespace std;
+
+		atomic<float> bound(numeric_limits<float>::infinity());
+		vector<nonfeaturePatchCandidate> shards(library.size());
+		parallelFor(0, library.size(), [&](int k) {
+			if (library[k].bank.count() == 0) {
+				shards[k].weight = numeric_limits<float>::infinity();
+				return;
+			}
+			shards[k] = findNonfeaturePatch(library[k].bank, target, params, &bound);
+			shards[k].example = k;
+		});
+
+		nonfeaturePatchCandidate best;
+		best.weight = numeric_limits<float>::infinity();
+		for (nonfeaturePatchCandidate &cand : shards) {
+			if (cand.weight < best.weight) best = move(cand);
+		}
+		return best;
+	}
+
+
+
+	// resume continues from a checkpoint of a run with the same inputs and
+	// parameters (see synthesizeResume), and can be null to start from scratch
+	// with params.checkpointPath set, checkpoints are written every
+	// params.checkpointInterval seconds (between batches, on a background
+	// thread) and once more when the synthesis is finished
+	// if provenance is given, it receives where every pixel was taken from in
+	// the examples (see resampleSynthesis)
+	// the library is analysed for params if it isn't already
+	inline cv::Mat synthesize(examplelibrary &library, const cv::Mat sketchmap, synthesisparams params, const checkpoint *resume = nullptr, provenancemap *provenance = nullptr) {
+		assert(!library.empty());
 		assert(sketchmap.type() == CV_32FC1);
 
 		using namespace cv;
 		using namespace std;
 
+		profile::scope prof("synthesize");
+
 		// unsynthesized regions are marked with NaN
 		Mat synthesis(sketchmap.rows, sketchmap.cols, CV_32FC1, Scalar(numeric_limits<float>::quiet_NaN()));
 		int hs1 = params.patchsize / 2;
 
-		// TODO for ridge and valley seperately
-		// 1) Identify features
-		//
-		ppa::FeatureGraph examplefeature(examplemap, params.ppaGridSpacing, params.profile_length);
-		ppa::FeatureGraph sketchfeature(sketchmap, params.ppaGridSpacing, params.profile_length);
+		vector<fpatch> featuretargets;
+		vector<placementrecord> placements;
+		if (resume) {
+			if (resume->patchsize != params.patchsize || resume->exampleSizes != library.sizes() || resume->synthesis.size() != sketchmap.size()) {
+				cerr << "Checkpoint was made with patchsize=" << resume->patchsize << ", " << resume->exampleSizes.size() << " examples, sketch " << resume->synthesis.size() << endl;
+				throw runtime_error("Checkpoint doesn't match the synthesis.");
+			}
+			resume->synthesis.copyTo(synthesis);
+			featuretargets = resume->featuretargets;
+			placements = resume->placements;
+			if (provenance) {
+				*provenance = provenancemap(synthesis.size());
+				if (!resume->provenanceIds.empty()) {
+					resume->provenanceCoords.copyTo(provenance->coords);
+					resume->provenanceIds.copyTo(provenance->ids);
+					resume->provenanceExamples.copyTo(provenance->examples);
+				}
+				else {
+					cerr << "Checkpoint has no provenance, pixels synthesized before it are left unknown" << endl;
+				}
+			}
+			if (resume->phase == checkpoint::PHASE_DONE) return synthesis;
+		}
+		else {
+			if (provenance) *provenance = provenancemap(synthesis.size());
+		}
 
-		// 2) Extract feature patches
+		// 1) Identify features and 2) extract feature patches, along with the
+		// rest of the analysis the placement needs
 		//
-		vector<fpatch> featurepatches = extractFeaturePatches(examplefeature, params.patchsize);
+		// the stages run as a task graph, so the analysis of the sketch overlaps
+		// the analysis of any example not analysed yet (a resumed run already has
+		// the patches, and reuses the example patches from the checkpoint)
+		profile::scope prof_analysis("synthesize.analysis");
+		unique_ptr<ppa::FeatureGraph> sketchfeature;
+		{
+			taskgraph analysis;
+			library.addAnalysis(analysis, params, resume ? &resume->featurepatches : nullptr);
+			if (!resume) {
+				int sketchPPA = analysis.add("synthesize.ppa.sketch", [&] {
+					sketchfeature.reset(new ppa::FeatureGraph(sketchmap, params.ppaGridSpacing, params.profile_length));
+				});
+				analysis.add("synthesize.extract.sketch", [&] {
+					featuretargets = extractFeaturePatches(*sketchfeature, params.patchsize);
+					sketchfeature.reset();
+				}, { sketchPPA });
+			}
+			analysis.run();
+		}
+		prof_analysis.end();
+		const vector<fpatch> featurepatches = library.featurepatches();
+		profile::counter("feature.patches", featurepatches.size());
+		profile::counter("feature.targets", featuretargets.size());
+		for (int k = 0; k < library.size(); ++k) {
+			if (!library[k].rotations.empty()) profile::counter("feature.rotations.bytes", library[k].rotations.bytes());
+			profile::counter("nonfeature.patches", library[k].bank.count());
+			profile::counter("nonfeature.bank.bytes", library[k].bank.bytes());
+		}
+
+		// the analysis is given to the writer once, snapshots only copy the state
+		// of the run: the synthesis, the provenance (all modified by the next
+		// batch) and the placement records (the masks are shared)
+		checkpointwriter checkpoints(params.checkpointPath, params.checkpointInterval);
+		if (checkpoints.enabled()) {
+			checkpoint analysis;
+			analysis.patchsize = params.patchsize;
+			analysis.exampleSizes = library.sizes();
+			analysis.featurepatches = featurepatches;
+			analysis.featuretargets = featuretargets;
+			checkpoints.setAnalysis(move(analysis));
+		}
+		auto snapshot = [&](int phase) {
+			checkpoint c;
+			c.phase = phase;
+			c.synthesis = synthesis.clone();
+			c.placements = placements;
+			if (provenance) {
+				c.provenanceCoords = provenance->coords.clone();
+				c.provenanceIds = provenance->ids.clone();
+				c.provenanceExamples = provenance->examples.clone();
+			}
+			return c;
+		};
 
 		// 3) Place feature patches
 		//
-		for (fpatch target : extractFeaturePatches(sketchmap, params.patchsize)) {
-			// calculate primary costs for relevant patches
-			priority_queue<featurePatchCandidate> candidates;
-			featurePatchCandidate best;
-			best.weight = numeric_limits<float>::infinity();
-			for (fpatch candidate : featurepatches) {
-				// find the best matching feature patch
-				if (candidate.controlpoints.size() == target.controlpoints.size()) {
-					featurePatchCandidate cand = createFeaturePatchCandidate(examplemap, synthesis, candidate, target, params);
-					if (cand.weight < best.weight) {
-						best = cand;
-					}
-				}
+		// targets are placed in batches, each target joining the batch only if its
+		// footprint doesn't touch the footprint of any earlier target still to be
+		// placed, so a target only ever goes ahead of targets it can't interact with
+		// and the result is the same as placing them in order (and the same for any
+		// thread count). Targets left out are evaluated in a later batch against the
+		// updated synthesis.
+		//
+		// While a batch is placed, the search also runs for upcoming targets whose
+		// footprint the batch can't touch. Those results are kept until a later
+		// placement writes inside their footprint, and are otherwise used in place
+		// of searching again when the target's turn comes.
+		profile::scope prof_feature("synthesize.feature");
+		{
+			const Rect synthesisBound(Point(0, 0), synthesis.size());
+			vector<Rect> footprints;
+			for (const fpatch &target : featuretargets) {
+				footprints.push_back(featureTargetFootprint(target, params) & synthesisBound);
+			}
+
+			vector<int> pending(featuretargets.size());
+			for (int i = 0; i < int(pending.size()); ++i) pending[i] = i;
+			if (resume) {
+				pending = resume->phase == checkpoint::PHASE_FEATURE ? resume->pendingFeatures : vector<int>();
 			}
 
-			// if we didn't find a matching candidate, use a non-matching candidate
-			if (isinf(best.weight)) {
-				for (fpatch candidate : featurepatches) {
-					if (candidate.controlpoints.size() != target.controlpoints.size()) {
-						featurePatchCandidate cand = createFeaturePatchCandidate(examplemap, synthesis, candidate, target, params);
-						if (cand.weight < best.weight) {
-							best = cand;
+			speculativecache<featurePatchCandidate> speculative;
+			Mat blocked(synthesis.size(), CV_8UC1);
+			while (!pending.empty()) {
+				profile::scope prof_batch("feature.batch");
+
+				vector<int> batch, deferred;
+				blocked.setTo(0);
+				for (int index : pending) {
+					if (int(batch.size()) >= params.featureBatchSize) {
+						deferred.push_back(index);
+						continue;
+					}
+					const Rect &footprint = footprints[index];
+					if (footprint.empty() || countNonZero(blocked(footprint)) == 0) {
+						batch.push_back(index);
+					}
+					else {
+						deferred.push_back(index);
+					}
+					if (!footprint.empty()) blocked(footprint).setTo(1);
+				}
+				pending.swap(deferred);
+				profile::counter("feature.batch.size", batch.size());
+
+				// upcoming targets that can be searched while the batch is placed
+				vector<int> lookahead;
+				for (int index : pending) {
+					if (int(lookahead.size()) >= params.featureLookahead) break;
+					if (speculative.contains(index)) continue;
+					bool independent = true;
+					for (int placed : batch) {
+						if (!(footprints[index] & footprints[placed]).empty()) {
+							independent = false;
+							break;
 						}
 					}
+					if (independent) lookahead.push_back(index);
 				}
-			}
 
-			//cout << best.weight << endl;
-			//imwrite("output/patch.png", best.patch);
-			//imwrite("output/synthesis.png", synthesis);
-			//Mat gc(best.graphcut.size(), CV_8UC1);
-			//for (int i = 0; i < gc.rows; ++i) {
-			//	for (int j = 0; j < gc.cols; ++j) {
-			//		gc.at<uchar>(i, j) = (best.graphcut.at<uchar>(i, j) ? 255 : 0);
-			//	}
-			//}
-			//imwrite("output/graphcut.png", gc);
+				vector<placementrecord> placed(batch.size());
+				parallelFor(0, int(batch.size() + lookahead.size()), [&](int b) {
+					if (b >= int(batch.size())) {
+						profile::scope prof_speculative("feature.speculative");
+						int index = lookahead[b - batch.size()];
+						speculative.store(index, footprints[index], findFeaturePatch(library, synthesis, featuretargets[index], params, provenance != nullptr));
+						return;
+					}
+					profile::scope prof_target("feature.target");
+					const fpatch &target = featuretargets[batch[b]];
+					featurePatchCandidate best;
+					if (speculative.take(batch[b], best)) {
+						profile::counter("feature.speculative.hits", 1);
+					}
+					else {
+						best = findFeaturePatch(library, synthesis, target, params, provenance != nullptr);
+					}
+					Vec2i position(target.center[0] - hs1, target.center[1] - hs1);
+					zhou::placePatch(synthesis, best.patch, best.graphcut, position, params.seamSolver, provenance, best.coords, int(placements.size()) + b, best.fp ? best.fp->example : 0);
+					placed[b] = placementrecord{ checkpoint::PHASE_FEATURE, position, best.graphcut };
+				});
+				placements.insert(placements.end(), placed.begin(), placed.end());
+
+				// the placements only wrote inside their footprints
+				for (int index : batch) {
+					profile::counter("feature.speculative.invalidated", speculative.invalidate(footprints[index]));
+				}
 
-			// place patch
-			zhou::placePatch(synthesis, best.patch, best.graphcut, Vec2i(target.center[0] - hs1, target.center[1] - hs1));
-			//imwrite("output/synthesis.png", zhou::heightmapToImage(synthesis, 0, 4000));
+				bool interrupted = params.interrupt && params.interrupt();
+				if (interrupted || checkpoints.due()) {
+					checkpoint c = snapshot(checkpoint::PHASE_FEATURE);
+					c.pendingFeatures = pending;
+					if (interrupted) {
+						checkpoints.finish(move(c));
+						return synthesis;
+					}
+					checkpoints.write(move(c));
+				}
+			}
 		}
+		prof_feature.end();
 
 
-		// 4) Extract and place non-feature patches
+		// 4) Place non-feature patches
 		//
-		vector<Mat> nonfeaturePatches = extractNonfeaturePatches(examplemap, featurepatches, params.patchsize);
-
-		auto cmp = [](const nonfeaturePatchTarget &left, const nonfeaturePatchTarget &right) { return left.overlappingPixels > right.overlappingPixels; };
-		priority_queue<nonfeaturePatchTarget, vector<nonfeaturePatchTarget>, decltype(cmp)> targetPatches(cmp);
+		profile::scope prof_nonfeature("synthesize.nonfeature");
+		if (!library.hasNonfeaturePatches()) {
+			if (checkpoints.enabled()) checkpoints.finish(snapshot(checkpoint::PHASE_DONE));
+			return synthesis;
+		}
 
-		int maxOverlap = params.patchsize * params.patchsize;
-		for (int offset = 0; offset < params.nonfeatureSpacing; offset += params.patchsize/2) {
-			for (int y = -hs1; y < synthesis.rows; y += params.nonfeatureSpacing) {
-				for (int x = -hs1; x < synthesis.cols; x += params.nonfeatureSpacing) {
+		// coverage is tracked incrementally so target priorities can be kept
+		// up to date as patches are placed, without rescanning the targets
+		coveragemap coverage(synthesis);
 
-					nonfeaturePatchTarget target;
+		// heap entries are (uncovered pixels, target index), smallest first
+		// entries are never removed, when a target's count changes a new entry
+		// is pushed and any entry that no longer matches the target is skipped
+		typedef pair<int, int> targetentry;
+		priority_queue<targetentry, vector<targetentry>, greater<targetentry>> targetPatches;
 
-					// set position
-					target.position = Vec2i(offset + x, offset + y);
+		int maxOverlap = params.patchsize * params.patchsize;
+		int across = (synthesis.cols + hs1 + params.nonfeatureSpacing - 1) / params.nonfeatureSpacing;
+		int down = (synthesis.rows + hs1 + params.nonfeatureSpacing - 1) / params.nonfeatureSpacing;
+		const bool resumePass = resume && resume->phase == checkpoint::PHASE_NONFEATURE;
+		for (int offset = resumePass ? resume->nonfeatureOffset : 0; offset < params.nonfeatureSpacing; offset += params.patchsize/2) {
+			profile::scope prof_schedule("nonfeature.schedule");
+
+			// targets for this pass lie on a regular grid
+			int origin = offset - hs1;
+			vector<nonfeaturePatchTarget> targets(across * down);
+			auto targetRect = [&](int index) {
+				return Rect(Point(targets[index].position), Size(params.patchsize, params.patchsize));
+			};
+
+			for (int gy = 0; gy < down; ++gy) {
+				for (int gx = 0; gx < across; ++gx) {
+					int index = gy * across + gx;
+					nonfeaturePatchTarget &target = targets[index];
+					target.position = Vec2i(origin + gx * params.nonfeatureSpacing, origin + gy * params.nonfeatureSpacing);
+					target.overlappingPixels = coverage.uncovered(targetRect(index));
+					if (resumePass && offset == resume->nonfeatureOffset && resume->nonfeatureDone.size() == targets.size()) {
+						target.done = resume->nonfeatureDone[index] != 0;
+					}
+					if (!target.done && target.overlappingPixels < maxOverlap) {
+						targetPatches.push(targetentry(target.overlappingPixels, index));
+					}
+				}
+			}
+			prof_schedule.end();
 
-					Mat targetCoords(params.patchsize, params.patchsize, CV_16SC2);
-					for (int i = 0; i < params.patchsize; ++i) {
-						for (int j = 0; j < params.patchsize; ++j) {
-							targetCoords.at<Vec2s>(i, j) = Vec2s(offset + x + j, offset + y + i);
+			// synthesize non-feature patches
+			// targets are taken in batches, in priority order, skipping any whose
+			// window (plus the seam halo) would overlap one already in the batch
+			// a placement only touches its window grown by one pixel, so the batch
+			// can be placed concurrently with the same result as placing it in order
+			// the batches depend on nonfeatureBatchSize, never on the thread count
+			// upcoming targets are searched while a batch is placed, as for features
+			const int halo = 1;
+			speculativecache<nonfeaturePatchCandidate> speculative;
+			while (!targetPatches.empty()) {
+				profile::scope prof_batch("nonfeature.batch");
+
+				vector<int> batch;
+				vector<Rect> claimed;
+				vector<targetentry> deferred;
+				int examined = 0;
+				while (!targetPatches.empty() && int(batch.size()) < params.nonfeatureBatchSize && examined < 4 * params.nonfeatureBatchSize) {
+					targetentry entry = targetPatches.top();
+					targetPatches.pop();
+					nonfeaturePatchTarget &target = targets[entry.second];
+					if (target.done || target.overlappingPixels != entry.first) continue;
+					examined++;
+
+					Rect area = targetRect(entry.second);
+					Rect grown(area.x - halo, area.y - halo, area.width + 2 * halo, area.height + 2 * halo);
+					bool conflict = false;
+					for (const Rect &other : claimed) {
+						if (!(grown & other).empty()) {
+							conflict = true;
+							break;
 						}
 					}
-					remap(synthesis, target.patch, targetCoords, Mat(), INTER_NEAREST, BORDER_CONSTANT, Scalar(numeric_limits<float>::quiet_NaN()));
-
-					// count overlapping values
-					target.overlappingPixels = 0;
-					for (int i = 0; i < params.patchsize; ++i) {
-						for (int j = 0; j < params.patchsize; ++j) {
-							if (isnan(target.patch.at<float>(i, j)))
-								target.overlappingPixels++;
+					if (conflict) {
+						deferred.push_back(entry);
+					}
+					else {
+						target.done = true;
+						batch.push_back(entry.second);
+						claimed.push_back(grown);
+					}
+				}
+				for (const targetentry &entry : deferred) {
+					targetPatches.push(entry);
+				}
+				profile::counter("nonfeature.batch.size", batch.size());
+
+				// pending targets the batch can't touch, in priority order
+				vector<int> lookahead;
+				deferred.clear();
+				examined = 0;
+				while (!targetPatches.empty() && int(lookahead.size()) < params.nonfeatureLookahead && examined < 4 * params.nonfeatureLookahead) {
+					targetentry entry = targetPatches.top();
+					targetPatches.pop();
+					if (targets[entry.second].done || targets[entry.second].overlappingPixels != entry.first) continue;
+					examined++;
+					deferred.push_back(entry);
+
+					if (speculative.contains(entry.second)) continue;
+					Rect area = targetRect(entry.second);
+					bool independent = true;
+					for (const Rect &other : claimed) {
+						if (!(area & other).empty()) {
+							independent = false;
+							break;
 						}
 					}
+					if (independent) lookahead.push_back(entry.second);
+				}
+				for (const targetentry &entry : deferred) {
+					targetPatches.push(entry);
+				}
 
-					if (target.overlappingPixels < maxOverlap) {
-						targetPatches.push(target);
+				// extract the target (NaN outside of the synthesis)
+				auto extractTarget = [&](int index) {
+					Rect area = targetRect(index);
+					Mat patch(params.patchsize, params.patchsize, CV_32FC1, Scalar(numeric_limits<float>::quiet_NaN()));
+					Rect inside = area & Rect(Point(0, 0), synthesis.size());
+					synthesis(inside).copyTo(patch(inside - area.tl()));
+					return patch;
+				};
+
+				vector<placementrecord> placed(batch.size());
+				parallelFor(0, int(batch.size() + lookahead.size()), [&](int b) {
+					if (b >= int(batch.size())) {
+						profile::scope prof_speculative("nonfeature.speculative");
+						int index = lookahead[b - batch.size()];
+						speculative.store(index, targetRect(index), findNonfeaturePatch(library, extractTarget(index), params));
+						return;
+					}
+					profile::scope prof_target("nonfeature.target");
+					nonfeaturePatchTarget &target = targets[batch[b]];
+					nonfeaturePatchCandidate best;
+					if (speculative.take(batch[b], best)) {
+						profile::counter("nonfeature.speculative.hits", 1);
 					}
+					else {
+						target.patch = extractTarget(batch[b]);
+						best = findNonfeaturePatch(library, target.patch, params);
+						target.patch.release();
+					}
+					Mat coords;
+					if (provenance) coords = translationCoords(library[best.example].nonfeatureOrigins[best.source], best.patch.size());
+					zhou::placePatch(synthesis, best.patch, best.graphcut, target.position, params.seamSolver, provenance, coords, int(placements.size()) + b, best.example);
+					placed[b] = placementrecord{ checkpoint::PHASE_NONFEATURE, target.position, best.graphcut };
+				});
+				placements.insert(placements.end(), placed.begin(), placed.end());
+
+				// the placements only wrote inside their claimed windows
+				for (const Rect &written : claimed) {
+					profile::counter("nonfeature.speculative.invalidated", speculative.invalidate(written));
 				}
-			}
 
-
-			// synthesize non-feature patches
-			while (!targetPatches.empty()) {
-				nonfeaturePatchTarget target = targetPatches.top();
-				targetPatches.pop();
-
-				// find the best candidate
-				nonfeaturePatchCandidate best;
-				best.weight = numeric_limits<float>::infinity();
-				for (Mat candidate : nonfeaturePatches) {
-					nonfeaturePatchCandidate cand = createNonfeaturePatchCandidate(candidate, target.patch, params);
-					if (cand.weight < best.weight) {
-						best = cand;
+				// reprioritize the pending targets that overlap the placements
+				profile::scope prof_update("nonfeature.update");
+				for (int index : batch) {
+					Rect area = targetRect(index);
+					if (coverage.update(synthesis, area) == 0) continue;
+					int gx0 = max(0, (area.x - params.patchsize - origin) / params.nonfeatureSpacing);
+					int gy0 = max(0, (area.y - params.patchsize - origin) / params.nonfeatureSpacing);
+					int gx1 = min(across - 1, (area.x + area.width - origin) / params.nonfeatureSpacing);
+					int gy1 = min(down - 1, (area.y + area.height - origin) / params.nonfeatureSpacing);
+					for (int gy = gy0; gy <= gy1; ++gy) {
+						for (int gx = gx0; gx <= gx1; ++gx) {
+							int other = gy * across + gx;
+							Rect otherArea = targetRect(other);
+							if (targets[other].done || (otherArea & area).empty()) continue;
+							int count = coverage.uncovered(otherArea);
+							if (count != targets[other].overlappingPixels) {
+								targets[other].overlappingPixels = count;
+								if (count < maxOverlap) targetPatches.push(targetentry(count, other));
+							}
+						}
 					}
 				}
-
-				zhou::placePatch(synthesis, best.patch, best.graphcut, target.position);
-				imwrite("output/synthesis.png", zhou::heightmapToImage(synthesis));
+				prof_update.end();
+
+				bool interrupted = params.interrupt && params.interrupt();
+				if (interrupted || checkpoints.due()) {
+					checkpoint c = snapshot(checkpoint::PHASE_NONFEATURE);
+					c.nonfeatureOffset = offset;
+					for (const nonfeaturePatchTarget &target : targets) {
+						c.nonfeatureDone.push_back(target.done);
+					}
+					if (interrupted) {
+						checkpoints.finish(move(c));
+						return synthesis;
+					}
+					checkpoints.write(move(c));
+				}
 			}
 		}
 
-
+		if (checkpoints.enabled()) checkpoints.finish(snapshot(checkpoint::PHASE_DONE));
 		return synthesis;
 	}
 
+
+	// synthesis from a single example
+	inline cv::Mat synthesize(const cv::Mat examplemap, const cv::Mat sketchmap, synthesisparams params, const checkpoint *resume = nullptr, provenancemap *provenance = nullptr) {
+		assert(examplemap.type() == CV_32FC1);
+		examplelibrary library;
+		library.add(examplemap);
+		return synthesize(library, sketchmap, params, resume, provenance);
+	}
+
+
+	// continues the run whose checkpoint is at params.checkpointPath, which must
+	// have been started with the same examples, sketch and parameters
+	inline cv::Mat synthesizeResume(examplelibrary &library, const cv::Mat sketchmap, synthesisparams params, provenancemap *provenance = nullptr) {
+		checkpoint resume = readCheckpoint(params.checkpointPath);
+		return synthesize(library, sketchmap, params, &resume, provenance);
+	}
+
+	inline cv::Mat synthesizeResume(const cv::Mat examplemap, const cv::Mat sketchmap, synthesisparams params, provenancemap *provenance = nullptr) {
+		checkpoint resume = readCheckpoint(params.checkpointPath);
+		return synthesize(examplemap, sketchmap, params, &resume, provenance);
+	}
+
 }
\ No newline at end of file